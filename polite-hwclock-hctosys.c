@@ -3,17 +3,31 @@
  * 
  */
 /* This code is based on techniques and ideas from hwclock: https://www.kernel.org/pub/linux/utils/util-linux/ */
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
+#include <linux/ptp_clock.h>
 #include <linux/rtc.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/timex.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
@@ -21,6 +35,7 @@
 #include <time.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -28,12 +43,23 @@
 #include <syslog.h>
 #include <stdarg.h>
 
+/* USDT probes so that bpftrace can watch a live daemon without -v, whose logging would disturb the timings it's 
+   logging, eg bpftrace -e 'usdt:/usr/local/bin/polite-hwclock-hctosys:rtc_read { print(arg2 - arg1); }'.  A probe is 
+   a single nop until something attaches to it.  Without sys/sdt.h (systemtap-sdt-dev) or with PHH_NO_SDT they compile 
+   to nothing. */
+#if !defined(PHH_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PHH_HAS_SDT
+#endif
+#endif
+
 
 #define PROGRAM_NAME "polite-hwclock-hctosys"
 
 #define LOG_WRITE_SYSTEM_V(sev__, fmt__, ...) syslog(severity_to_system_v_severity(sev__), fmt__, __VA_ARGS__)
 #define LOG_WRITE_SYSTEMD(sev__, fmt__, ...) fprintf(stderr, "%s" fmt__ "\n", severity_to_systemd_severity(sev__), __VA_ARGS__)
-#define LOG_WRITE_STANDALONE(sev__, fmt__, ...) fprintf(stderr, "%s %s" fmt__ "\n", get_log_time(), severity_to_human_readable_severity(sev__), __VA_ARGS__)
+#define LOG_WRITE_STANDALONE(sev__, fmt__, ...) (global_is_log_muted ? 0 : fprintf(stderr, "%s %s" fmt__ "\n", get_log_time(), severity_to_human_readable_severity(sev__), __VA_ARGS__))
 #define LOG_WRITE_RUN_MODE_SPECIFIC(sev__, fmt__, ...) ((RUN_MODE_SYSTEM_V == global_run_mode) ? LOG_WRITE_SYSTEM_V(sev__, fmt__, __VA_ARGS__) : ((RUN_MODE_SYSTEMD == global_run_mode) ? LOG_WRITE_SYSTEMD(sev__, fmt__, __VA_ARGS__) : LOG_WRITE_STANDALONE(sev__, fmt__, __VA_ARGS__)))
 
 #define LOG_WRITE(sev__, fmt__, ...) LOG_WRITE_RUN_MODE_SPECIFIC(sev__, fmt__, __VA_ARGS__)
@@ -45,18 +71,177 @@
 #define LOG_WRITE_VERBOSE(fmt__, ...) (global_is_verbose ? LOG_WRITE(LOG_SEVERITY_DEBUG, "%" PRIu64 ": " fmt__, (uint64_t)clock(), __VA_ARGS__) : 0)
 #define LOG_WRITE_VERBOSE_NARG(fmt__) (global_is_verbose ? LOG_WRITE_VERBOSE(fmt__ "%s", "") : 0)
 
-#define USEC_FMT PRId64
+#ifdef PHH_HAS_SDT
+#define PROBE1(name__, a1__) DTRACE_PROBE1(polite_hwclock, name__, a1__)
+#define PROBE2(name__, a1__, a2__) DTRACE_PROBE2(polite_hwclock, name__, a1__, a2__)
+#define PROBE3(name__, a1__, a2__, a3__) DTRACE_PROBE3(polite_hwclock, name__, a1__, a2__, a3__)
+#define PROBE4(name__, a1__, a2__, a3__, a4__) DTRACE_PROBE4(polite_hwclock, name__, a1__, a2__, a3__, a4__)
+#define PROBE5(name__, a1__, a2__, a3__, a4__, a5__) DTRACE_PROBE5(polite_hwclock, name__, a1__, a2__, a3__, a4__, a5__)
+#else
+#define PROBE1(name__, a1__) ((void)(a1__))
+#define PROBE2(name__, a1__, a2__) ((void)(a1__), (void)(a2__))
+#define PROBE3(name__, a1__, a2__, a3__) ((void)(a1__), (void)(a2__), (void)(a3__))
+#define PROBE4(name__, a1__, a2__, a3__, a4__) ((void)(a1__), (void)(a2__), (void)(a3__), (void)(a4__))
+#define PROBE5(name__, a1__, a2__, a3__, a4__, a5__) ((void)(a1__), (void)(a2__), (void)(a3__), (void)(a4__), (void)(a5__))
+#endif
+
+#define NSEC_FMT PRId64
+#define NSEC_PER_SEC 1000000000LL
 #define PID_FILE_NAME "/var/run/" PROGRAM_NAME ".pid"
-#define MIN_ADJUSTMENT_DELTA_SEC 1
+#define STATE_FILE_NAME "/var/lib/" PROGRAM_NAME ".state"
+/* Version 1 had times in usec rather than nsec. */
+#define STATE_FILE_VERSION 2
+#define STATE_SAVE_INTERVAL_SEC 600
+#define BOOT_ID_FILE_NAME "/proc/sys/kernel/random/boot_id"
+/* Trace files are a ring of this many records, about 3.5MB. */
+#define TRACE_CAPACITY 65536
+#define TRACE_MAGIC "PHHTRACE"
+#define TRACE_VERSION 2
+/* Recorded when set_time() didn't need to look at the current adjtime() delta. */
+#define TRACE_NO_ADJTIME_DELTA INT64_MAX
+/* How often the metrics file is rewritten. */
+#define METRICS_WRITE_INTERVAL_SEC 15
+#define METRICS_PREFIX "polite_hwclock_"
+/* Every histogram has this many buckets plus +Inf. */
+#define METRICS_HISTOGRAM_BUCKETS 8
+/* How many recent precise deltas we remember. */
+#define DELTA_HISTORY_LEN 8
+/* Settings in CONFIG_FILE_NAME, which is re-read on SIGHUP.  The macros are the defaults. */
+#define CONFIG_FILE_NAME "/etc/" PROGRAM_NAME ".conf"
+#define RTC_DEVICE_NAME "/dev/rtc0"
+#define MIN_ADJUSTMENT_DELTA_MSEC 50
+#define MIN_COARSE_ADJUSTMENT_DELTA_SEC 1
 #define MAX_POLITE_ADJUSTMENT_DELTA_SEC 5
-#define LOOP_POLL_SEC 1
+/* When the backward step policy (-b) allows it, backward steps are allowed for this long after starting or resuming. */
+#define BACKWARD_STEP_WINDOW_SEC 300
+/* The daemon polls every MIN_LOOP_POLL_SEC, backing off exponentially to MAX_LOOP_POLL_SEC while the clock is 
+   stable. */
+#define MIN_LOOP_POLL_SEC 1
+#define MAX_LOOP_POLL_SEC 64
+/* How many stable samples in a row we need before polling less often. */
+#define LOOP_POLL_BACKOFF_SAMPLES 4
+/* The clock change timer has to expire sometime, so it's re-armed this far into the future. */
+#define CLOCK_CHANGE_TIMER_SEC (365 * 24 * 60 * 60)
+/* Ignore suspends shorter than this. */
+#define MIN_SUSPEND_MSEC 100
+/* A clock change is our own step if CLOCK_REALTIME - CLOCK_MONOTONIC is still within this of where the step left it. */
+#define OWN_STEP_MATCH_NSEC (1000 * 1000)
+/* We tell systemd we're ready after the first successful sync, or after this many tries so that a broken RTC can't 
+   hold up the boot. */
+#define NOTIFY_READY_MAX_ITERATIONS 5
+
+/* The RTC phase tracker needs this many edges before it will predict sub-second RTC time, and will re-learn the phase 
+   from a fresh edge once its anchor is this old. */
+#define RTC_PHASE_MIN_EDGES 3
+#define RTC_PHASE_MAX_AGE_SEC 32
+/* Predictions this close to an edge are ambiguous because we can't tell which side of the edge RTC_RD_TIME saw. */
+#define RTC_PHASE_GUARD_NSEC (20 * 1000 * 1000)
+/* An edge this far from where we expected it means the RTC or the system was stepped or suspended. */
+#define RTC_PHASE_MAX_RESIDUAL_NSEC (100 * 1000 * 1000)
+/* Late edges move the anchor by 1/2^N of the residual. */
+#define RTC_PHASE_LATE_EDGE_SHIFT 3
+/* How many bracketed RTC reads make up one measurement when the phase tracker is locked. */
+#define RTC_BURST_SAMPLES 8
+/* Even a phase this old is good enough to know roughly when the next tick interrupt is due. */
+#define RTC_PHASE_TIMEOUT_MAX_AGE_SEC 256
+
+/* We give up waiting for a tick interrupt this long after we expected it, or after 1 second plus this long if we 
+   don't know when to expect it.  The margin grows with the interrupt latency jitter we've seen. */
+#define RTC_TICK_MIN_MARGIN_MSEC 20
+#define RTC_TICK_JITTER_MARGIN_MULTIPLE 4
+/* When the tick interrupt goes missing we poll RTC_RD_TIME this often to catch the second ticking over, but not more 
+   than once per RTC_POLL_FALLBACK_MIN_INTERVAL_SEC and never for longer than RTC_POLL_MAX_MSEC. */
+#define RTC_POLL_STEP_NSEC (2 * 1000 * 1000)
+#define RTC_POLL_LEAD_MSEC 10
+#define RTC_POLL_MAX_MSEC 1100
+#define RTC_POLL_FALLBACK_MIN_INTERVAL_SEC 10
+/* The RTCs PCs have, and the ones hypervisors emulate, start the next second 500 msec after RTC_SET_TIME, so to line 
+   the RTC's edges up with the system clock's seconds we set it to N when the system clock is at N + 0.5 sec, like 
+   hwclock does. */
+#define RTC_SET_DELAY_NSEC (500 * 1000 * 1000)
+/* We sleep until this long before then and spin the rest of the way, and try again the next second if we ended up 
+   later than RTC_SET_MAX_LATE_NSEC, up to RTC_SET_MAX_TRIES times. */
+#define RTC_SET_SPIN_NSEC (2 * 1000 * 1000)
+#define RTC_SET_MAX_LATE_NSEC (1000 * 1000)
+#define RTC_SET_MAX_TRIES 5
+/* -w writes the system time back to the RTC at most this often. */
+#define RTC_WRITE_BACK_MIN_INTERVAL_SEC (60 * 60)
+
+/* By default we look for a PTP clock that tells the hypervisor host's time, which is the same time the RTC tells but 
+   to the nanosecond and without waiting for a tick. */
+#define PTP_DEVICE_AUTO "auto"
+#define PTP_DEVICE_NONE "none"
+#define PTP_MAX_DEVICES 16
+/* How many cross-timestamps make up one measurement. */
+#define PTP_SAMPLES 9
+/* PTP_SYS_OFFSET_PRECISE cross-timestamps are taken together by the hardware so are only out by rounding. */
+#define PTP_PRECISE_ERROR_NSEC 1
+
+/* -R touches this much stack up front so that the measurement window doesn't page fault on it. */
+#define STACK_PREFAULT_BYTES (64 * 1024)
+
+/* Samples on their way from the measurement thread to the control thread.  A power of two, and there's normally only 
+   one in flight. */
+#define SAMPLE_QUEUE_CAPACITY 8
+/* The measurement thread's stack, which -R locks into RAM. */
+#define MEASUREMENT_THREAD_STACK_BYTES (256 * 1024)
+
+/* How long we watch the delta drift before working out the system clock's frequency error. */
+#define FREQ_ESTIMATE_INTERVAL_SEC 256
+/* The kernel refuses frequency offsets bigger than this. */
+#define FREQ_MAX_PPM 500
+/* The offset estimator assumes the offset and the skew wander as random walks, growing by this much per square root 
+   second. */
+#define ESTIMATOR_OFFSET_WANDER_NSEC 1000
+#define ESTIMATOR_SKEW_WANDER_PPB 10
+/* Samples this many standard deviations from what the estimator expected are outliers and ignored, unless we get this 
+   many in a row, which means the clock really did jump. */
+#define ESTIMATOR_OUTLIER_SIGMAS 5
+#define ESTIMATOR_MAX_OUTLIERS 3
+/* We only act on the estimated delta once it's clear of the threshold by this many standard deviations. */
+#define ESTIMATOR_CONFIDENCE_SIGMAS 2
+/* adjtimex() frequencies are in ppm with a 16-bit fractional part. */
+#define ADJTIMEX_FREQ_SCALE 65536
+/* adjtime() always slews at this rate.  Faster polite adjustments (-s) lengthen or shorten the kernel's tick instead, 
+   which it allows by up to 10%. */
+#define ADJTIME_SLEW_PPM 500
+#define MAX_SLEW_PPM 100000
+/* We leave the clock alone while the kernel says something else (an NTP daemon, usually) has synchronised it and that 
+   thing's maximum error estimate is below this.  The kernel grows the estimate by 500 ppm when nobody updates it, so 
+   2 seconds allows for timesyncd's 2048 second polls. */
+#define NTP_MAX_ERROR_MSEC 2000
+/* The kernel marks the clock unsynchronised by itself once the maximum error reaches this. */
+#define NTP_PHASE_LIMIT_SEC 16
+
+/* measure takes this many samples over this long by default.  Each sample takes a couple of seconds. */
+#define MEASURE_SAMPLES 60
+#define MEASURE_DURATION_SEC 300
+#define MEASURE_MAX_SAMPLES 100000
+
+/* The simulated clocks start at this time, a whole second so that the RTC's edges are easy to reason about. */
+#define SIM_EPOCH_SEC 1700000000
+/* Linux slews adjtime() adjustments at this rate. */
+#define SIM_SLEW_PPM 500
+/* How long the simulated syscalls take. */
+#define SIM_RTC_READ_NSEC (30 * 1000)
+#define SIM_CLOCK_READ_NSEC 50
+/* The simulated error is sampled this often, and the clock counts as converged once the error stays under 
+   SIM_CONVERGED_MSEC. */
+#define SIM_ERROR_SAMPLE_SEC 1
+#define SIM_CONVERGED_MSEC 100
+/* Every scenario starts from the same seed so that runs can be compared. */
+#define SIM_RANDOM_SEED 0x9e3779b97f4a7c15ULL
 
 
 
 typedef enum {
     RUN_MODE_SYSTEM_V,
     RUN_MODE_SYSTEMD,
-    RUN_MODE_ONCE
+    RUN_MODE_ONCE,
+    RUN_MODE_REPLAY,
+    RUN_MODE_SIMULATE,
+    RUN_MODE_MEASURE,
+    RUN_MODE_SYSTOHC
 } run_mode_t;
 
 typedef enum {
@@ -66,22 +251,582 @@ typedef enum {
     LOG_SEVERITY_DEBUG = 7
 } log_severity_t;
 
+/* When we're allowed to step the clock backwards, as a bitmask. */
+typedef enum {
+    BACKWARD_STEP_NEVER = 0,
+    BACKWARD_STEP_STARTUP = 1,
+    BACKWARD_STEP_RESUME = 2,
+    BACKWARD_STEP_ALWAYS = 4
+} backward_step_policy_t;
+
+typedef enum {
+    SET_TIME_ACTION_NONE,
+    SET_TIME_ACTION_ALREADY_ADJUSTING,
+    SET_TIME_ACTION_POLITE,
+    SET_TIME_ACTION_IMPOLITE,
+    /* Something else is disciplining the clock so we only measured. */
+    SET_TIME_ACTION_DEFER_TO_NTP
+} set_time_action_t;
+
+typedef struct {
+    int64_t hw_nsec;
+    int64_t sys_nsec;
+    /* How wrong hw_nsec - sys_nsec could be. */
+    int64_t error_nsec;
+} time_sample_t;
+
+typedef struct {
+    /* The delta we'd have once any pending slew has finished. */
+    int64_t eventual_delta;
+    /* eventual_delta plus the pending slew, ie our best guess at the delta right now. */
+    int64_t delta;
+    /* Standard deviation of both of those. */
+    int64_t sigma;
+    /* How fast eventual_delta grows, in nsec per nsec.  0 until we've had two samples. */
+    double skew;
+    bool has_skew;
+    /* False if all we've seen are deltas truncated to the second. */
+    bool is_precise;
+    /* The sample didn't fit the estimate so we ignored it. */
+    bool is_outlier;
+} estimate_t;
+
+typedef struct {
+    /* Same meaning as get_delta()'s return value. */
+    int delta_rc;
+    time_sample_t sample;
+    /* CLOCK_MONOTONIC_RAW time just after the sample was taken. */
+    int64_t mono_nsec;
+    int64_t delta;
+    int64_t delta_error;
+    /* Estimated eventual deltas smaller than this are ignored. */
+    int64_t min_delta;
+    /* TRACE_NO_ADJTIME_DELTA if we didn't get as far as looking at it. */
+    int64_t current_adjtime_delta;
+    estimate_t estimate;
+    set_time_action_t action;
+    /* The action was a backward step that we weren't allowed to make. */
+    bool is_backward_step_refused;
+} set_time_result_t;
+
+/* Trace files are a trace_header_t followed by a ring of trace_record_t, all in native byte order. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t reserved;
+    /* How many records have ever been written, so the next one goes at next_index % capacity. */
+    uint64_t next_index;
+} trace_header_t;
+
+typedef struct {
+    int64_t mono_nsec;
+    int64_t hw_nsec;
+    int64_t sys_nsec;
+    int64_t error_nsec;
+    int64_t adjtime_delta_nsec;
+    int32_t hw_rc;
+    int32_t set_time_rc;
+    int32_t action;
+    int32_t poll_interval_sec;
+} trace_record_t;
+
+_Static_assert(sizeof(trace_header_t) == 32, "trace_header_t is part of the trace file format");
+_Static_assert(sizeof(trace_record_t) == 56, "trace_record_t is part of the trace file format");
+
+typedef struct {
+    size_t map_size;
+    trace_header_t *header;
+    trace_record_t *records;
+} trace_t;
+
+typedef struct {
+    int interval_sec;
+    unsigned int stable_count;
+} poll_state_t;
+
+typedef enum {
+    LOOP_EVENT_NONE = 0,
+    LOOP_EVENT_POLL = 1,
+    /* Somebody other than us set CLOCK_REALTIME. */
+    LOOP_EVENT_CLOCK_SET = 2,
+    LOOP_EVENT_RESUMED = 4,
+    /* The measurement thread has queued a sample. */
+    LOOP_EVENT_SAMPLE = 8
+} loop_event_t;
+
+typedef struct {
+    int epoll_fd;
+    /* CLOCK_BOOTTIME so that time spent suspended counts towards the poll interval. */
+    int timer_fd;
+    /* A CLOCK_REALTIME timer that's cancelled when the clock is set. */
+    int clock_change_fd;
+    /* Pings the systemd watchdog while we're idle, or -1 if it isn't enabled. */
+    int watchdog_fd;
+    /* The measurement thread's sample_fd once it's started, which the thread owns. */
+    int sample_fd;
+    /* CLOCK_BOOTTIME - CLOCK_MONOTONIC, ie the total time spent suspended, when we last looked. */
+    int64_t suspended_nsec;
+    /* SIGHUP is blocked except while we're waiting, so that a reload can't interrupt a measurement. */
+    sigset_t wait_sigmask;
+} event_loop_t;
+
+typedef struct {
+    /* CLOCK_MONOTONIC_RAW time at which we think the RTC ticked over to anchor_rtc_nsec. */
+    int64_t anchor_mono_nsec;
+    int64_t anchor_rtc_nsec;
+    unsigned int edge_count;
+    /* Smoothed lateness of the edges we've seen, relative to the anchor. */
+    int64_t jitter_nsec;
+} rtc_phase_t;
+
+typedef struct {
+    int64_t mono_nsec;
+    int64_t sys_nsec;
+    /* How far the real edge could be from mono_nsec/sys_nsec. */
+    int64_t error_nsec;
+} rtc_edge_t;
+
+/* Ways of cross-timestamping a PTP clock against the system clock, best first. */
+typedef enum {
+    PTP_METHOD_NONE,
+    PTP_METHOD_PRECISE,
+    PTP_METHOD_EXTENDED,
+    PTP_METHOD_BASIC
+} ptp_method_t;
+
+typedef struct {
+    int64_t sys_nsec;
+    int64_t delta_nsec;
+    int64_t error_nsec;
+} delta_history_entry_t;
+
+typedef struct {
+    delta_history_entry_t entries[DELTA_HISTORY_LEN];
+    unsigned int count;
+    /* Where the next entry goes. */
+    unsigned int next;
+} delta_history_t;
+
+typedef struct {
+    /* METRICS_HISTOGRAM_BUCKETS ascending upper bounds, +Inf is implicit. */
+    const double *bounds;
+    uint64_t counts[METRICS_HISTOGRAM_BUCKETS + 1];
+    double sum;
+    uint64_t count;
+} histogram_t;
+
+typedef struct {
+    histogram_t abs_delta_seconds;
+    histogram_t iteration_cpu_seconds;
+    histogram_t iteration_syscalls;
+    uint64_t iterations;
+    uint64_t errors;
+    /* Indexed by set_time_action_t. */
+    uint64_t actions[SET_TIME_ACTION_DEFER_TO_NTP + 1];
+    uint64_t refused_backward_steps;
+    /* Syscalls we've made ourselves, not counting vDSO calls like clock_gettime(). */
+    uint64_t syscalls;
+    bool has_last_delta;
+    int64_t last_delta_nsec;
+    int64_t last_delta_error_nsec;
+    uint64_t outliers;
+    bool has_estimate;
+    estimate_t last_estimate;
+} metrics_t;
+
+typedef struct {
+    uint64_t tick_waits;
+    uint64_t tick_timeouts;
+    uint64_t poll_fallbacks;
+    uint64_t poll_fallback_failures;
+    /* CLOCK_MONOTONIC_RAW time of the last poll fallback. */
+    int64_t last_poll_fallback_mono_nsec;
+    uint64_t rtc_writes;
+    /* Including writes that didn't verify. */
+    uint64_t rtc_write_failures;
+    int64_t last_rtc_write_mono_nsec;
+    histogram_t read_seconds;
+    histogram_t tick_wait_seconds;
+} rtc_stats_t;
+
+/* Everything that touches a real clock goes through a backend so that the control logic can be run against simulated 
+   clocks.  Each function behaves like the syscall it stands in for. */
+typedef struct {
+    const char *name;
+    int (*open_rtc)(void);
+    void (*close_rtc)(void);
+    int (*set_rtc_tick_interrupt)(bool is_enabled);
+    int (*read_rtc)(struct rtc_time *time);
+    int (*set_rtc)(const struct rtc_time *time);
+    /* Like select() on the RTC fd. */
+    int (*wait_for_rtc_interrupt)(int64_t timeout_nsec);
+    /* Like read() on the RTC fd, which resets it. */
+    int (*read_rtc_interrupt)(unsigned long *interrupt_info);
+    int (*get_monotonic_now)(int64_t *mono_nsec);
+    int (*get_system_now)(int64_t *epoch_nsec);
+    /* For the other clocks, eg CLOCK_MONOTONIC and CLOCK_BOOTTIME to tell steps and suspends from slewing. */
+    int (*clock_gettime)(clockid_t clock_id, struct timespec *ts);
+    void (*sleep_nsec)(int64_t nsec);
+    int (*adjtime)(const struct timeval *delta, struct timeval *old_delta);
+    int (*clock_adjtime)(clockid_t clock_id, struct timex *tx);
+    /* Fills in the device name of a PTP clock that tells the hypervisor host's time.  Returns 0 if there is one, >0 if 
+       not. */
+    int (*find_ptp)(char *device_name, size_t size);
+    int (*open_ptp)(const char *device_name);
+    void (*close_ptp)(void);
+    /* Like ioctl() on the PTP fd. */
+    int (*ptp_ioctl)(unsigned long request, void *arg);
+} clock_backend_t;
+
+typedef struct {
+    const char *name;
+    int64_t duration_sec;
+    /* How far ahead of the RTC the system clock starts. */
+    int64_t initial_offset_nsec;
+    /* Oscillator errors, positive means fast. */
+    double sys_drift_ppm;
+    double rtc_drift_ppm;
+    /* Tick interrupts arrive somewhere in this range after the edge, unless they're dropped. */
+    int64_t tick_latency_min_nsec;
+    int64_t tick_latency_max_nsec;
+    double tick_drop_probability;
+    /* RTC_RD_TIME takes SIM_RTC_READ_NSEC plus up to this much more. */
+    int64_t rtc_read_jitter_nsec;
+    /* Every pause_interval_sec the VM is paused for pause_sec, like WSL2 when the host sleeps. */
+    int64_t pause_interval_sec;
+    int64_t pause_sec;
+    /* If set there's a PTP clock telling the host's time, which is what the RTC tells too.  Like Hyper-V's, it only 
+       supports PTP_SYS_OFFSET and each read takes between this and twice this long. */
+    int64_t ptp_read_nsec;
+    /* If set an NTP daemon keeps the system clock in step with the RTC (which the kernel's 11 minute mode keeps in step 
+       with NTP) for this long, and then dies. */
+    int64_t ntp_sec;
+    /* simulate fails if, with or without -f, the clock takes longer than this to converge (0 if it isn't expected to), 
+       the mean error is more than max_mean_error_msec or the daemon wakes up more than max_wakeups times.  It also 
+       fails if the clock ends up further out than the initial offset and drift alone would have put it, or is stepped 
+       backwards without -b. */
+    int64_t max_converge_sec;
+    int64_t max_mean_error_msec;
+    uint64_t max_wakeups;
+} sim_scenario_t;
+
+/* Times are in nsec since the simulation started, except sys_nsec and rtc_nsec which are since SIM_EPOCH_SEC. */
+typedef struct {
+    const sim_scenario_t *scenario;
+    uint64_t random_state;
+    double true_nsec;
+    double mono_nsec;
+    double sys_nsec;
+    double rtc_nsec;
+    /* What's left of the last adjtime(). */
+    double adjtime_pending_nsec;
+    long freq;
+    long tick;
+    bool is_tick_interrupt_enabled;
+    bool is_tick_pending;
+    /* How many tick interrupts the RTC has raised. */
+    uint64_t tick_interrupts;
+    double next_pause_true_nsec;
+    /* adjtimex() status bits. */
+    int status;
+    /* How far ADJ_SETOFFSET has stepped sys_nsec, which CLOCK_MONOTONIC doesn't follow. */
+    double stepped_nsec;
+    /* Set by ADJ_SETOFFSET, like a TFD_TIMER_CANCEL_ON_SET timer being cancelled. */
+    bool is_clock_set;
+    uint64_t backward_steps;
+} sim_t;
+
+typedef struct {
+    double max_abs_error_nsec;
+    double sum_abs_error_nsec;
+    uint64_t error_samples;
+    /* When the error was last over SIM_CONVERGED_MSEC. */
+    double last_unconverged_true_nsec;
+    double final_error_nsec;
+    uint64_t wakeups;
+    uint64_t backward_steps;
+} sim_report_t;
+
+typedef struct {
+    bool is_active;
+    /* The tick length we found, which we put back when we're done, and the one we slew with. */
+    long original_tick;
+    long tick;
+    int64_t start_mono_nsec;
+    int64_t end_mono_nsec;
+    /* How far the clock will have moved when the slew ends. */
+    int64_t delta_nsec;
+} slew_t;
+
+typedef struct {
+    bool has_reference;
+    int64_t reference_mono_nsec;
+    /* The delta we'd have once any pending adjtime() slew finishes. */
+    int64_t reference_eventual_delta_nsec;
+    /* Clock adjustments we've made since the reference, which aren't drift. */
+    int64_t adjusted_nsec;
+} freq_estimator_t;
+
+/* A Kalman filter tracking the delta we'd have once any pending slew has finished, and how fast it drifts.  It's O(1) 
+   per sample so the history it's learned from doesn't have to be kept. */
+typedef struct {
+    /* How many samples the estimate is based on, saturating, or 0 if there isn't an estimate. */
+    unsigned int samples;
+    /* False if all we've seen are deltas truncated to the second. */
+    bool is_precise;
+    /* Samples in a row we've ignored as outliers. */
+    unsigned int outliers;
+    /* CLOCK_MONOTONIC_RAW time the estimate is for. */
+    int64_t mono_nsec;
+    double offset_nsec;
+    /* nsec per nsec, positive if the system clock is slow. */
+    double skew;
+    double offset_variance;
+    double covariance;
+    double skew_variance;
+} offset_estimator_t;
+
+typedef struct {
+    /* Only read at startup because we keep the RTC open. */
+    char rtc_device_name[64];
+    int min_adjustment_delta_msec;
+    int min_coarse_adjustment_delta_sec;
+    int max_polite_adjustment_delta_sec;
+    int min_poll_sec;
+    int max_poll_sec;
+    int poll_backoff_samples;
+    int rtc_tick_min_margin_msec;
+} config_t;
+
+/* A numeric config_t field, by its name in the config file. */
+typedef struct {
+    const char *name;
+    size_t offset;
+    int min;
+    int max;
+} config_setting_t;
+
+/* A sample from the measurement thread, with copies of the measurement state it was taken with so that the control 
+   thread can save and report them. */
+typedef struct {
+    /* The measurement thread's generation when the sample was started. */
+    uint64_t generation;
+    /* How many samples the control thread had asked for when this one was started, ie the requests it answers. */
+    uint64_t request;
+    /* The same as set_time_result_t's. */
+    int delta_rc;
+    time_sample_t sample;
+    int64_t delta;
+    int64_t mono_nsec;
+    rtc_phase_t rtc_phase;
+    rtc_stats_t rtc_stats;
+    ptp_method_t ptp_method;
+} measurement_t;
+
+/* A lock-free ring with one producer, the measurement thread, and one consumer, the control thread.  head and tail only 
+   ever grow, and each is only written by its own side, so on their own cache lines they don't bounce. */
+typedef struct {
+    measurement_t slots[SAMPLE_QUEUE_CAPACITY];
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+} sample_queue_t;
+
+/* The daemons capture RTC edges on a thread of their own, so that nothing the control thread does (deciding, adjusting, 
+   logging, writing state and metrics) can hold up a measurement.  The control thread asks for samples by setting the 
+   should_* flags and signalling wake_fd, and the measurement thread queues them and signals sample_fd.  The RTC, the 
+   PTP clock and the phase tracker belong to the measurement thread while it's running. */
+typedef struct {
+    bool is_running;
+    pthread_t thread;
+    sample_queue_t queue;
+    int wake_fd;
+    int sample_fd;
+    bool should_stop;
+    bool should_measure;
+    bool should_reset_rtc_phase;
+    bool should_write_rtc;
+    /* RTC writes the control thread has asked for, so it doesn't ask again before the samples show the result. */
+    uint64_t rtc_write_requests;
+    /* Bumped by the control thread after it changes the clock, so that it can throw away samples taken before. */
+    uint64_t generation;
+    /* Handed over at startup and after a SIGHUP, under config_lock. */
+    pthread_mutex_t config_lock;
+    config_t config;
+    bool has_new_config;
+    /* Handed over when the thread starts and when it stops. */
+    rtc_phase_t rtc_phase;
+    rtc_stats_t rtc_stats;
+    /* How many samples the control thread has asked for. */
+    uint64_t measure_requests;
+    /* The control thread's alone: the last request a sample answered, and the CLOCK_MONOTONIC_RAW time since which 
+       the thread has owed us a sample, or -1.  The watchdog isn't pinged once that's longer than a sample can take. */
+    uint64_t answered_requests;
+    int64_t owed_since_mono_nsec;
+} measurement_thread_t;
+
+/* One of the things measure reports the distribution of. */
+typedef struct {
+    const char *name;
+    int64_t *values;
+    size_t count;
+} measure_series_t;
+
 
 int global_rtc_fd = -1;
+bool global_is_rtc_open = false;
+bool global_is_rtc_tick_interrupt_enabled = false;
+int global_ptp_fd = -1;
+const char *global_ptp_device_name = PTP_DEVICE_AUTO;
+/* Thread local, like the rest of the measurement state, so that the control thread has its own copy to report. */
+__thread ptp_method_t global_ptp_method = PTP_METHOD_NONE;
+/* Set once we've given up on PTP so we don't keep looking. */
+bool global_is_ptp_unavailable = false;
+sim_t global_sim;
+const char *global_sim_scenario_name = NULL;
 bool global_is_verbose = false;
-char global_log_buf[128] = { '\0' };
+/* Without -v simulate only prints its table, since the simulated clocks log as much in a second as a daemon would in 
+   a month. */
+bool global_is_log_muted = false;
+__thread char global_log_buf[128] = { '\0' };
 run_mode_t global_run_mode = RUN_MODE_ONCE;
-bool global_should_exit = false;
+/* Set by the signal handler, so only touched with __atomic builtins since the measurement thread reads it too. */
+volatile sig_atomic_t global_should_exit = 0;
+volatile sig_atomic_t global_should_reload_config = 0;
+/* NULL means CONFIG_FILE_NAME if it exists, for the daemon and once modes. */
+const char *global_config_file_name = NULL;
+/* Our end of $NOTIFY_SOCKET, or -1 if we weren't started by systemd with Type=notify. */
+int global_notify_fd = -1;
+struct sockaddr_un global_notify_addr;
+socklen_t global_notify_addr_len = 0;
+/* Half of $WATCHDOG_USEC, or 0 if the watchdog isn't enabled. */
+int64_t global_watchdog_interval_nsec = 0;
+#define CONFIG_INITIALIZER { RTC_DEVICE_NAME, MIN_ADJUSTMENT_DELTA_MSEC, MIN_COARSE_ADJUSTMENT_DELTA_SEC, \
+        MAX_POLITE_ADJUSTMENT_DELTA_SEC, MIN_LOOP_POLL_SEC, MAX_LOOP_POLL_SEC, LOOP_POLL_BACKOFF_SAMPLES, \
+        RTC_TICK_MIN_MARGIN_MSEC }
+/* Thread local so that a reload can't change it under a measurement.  The measurement thread gets a copy. */
+__thread config_t global_config = CONFIG_INITIALIZER;
+/* While there's a measurement thread the control thread's copy is the one that came with the last sample. */
+__thread rtc_phase_t global_rtc_phase = { 0, 0, 0, 0 };
+bool global_is_freq_discipline_enabled = false;
+freq_estimator_t global_freq_estimator = { false, 0, 0, 0 };
+offset_estimator_t global_offset_estimator;
+int64_t global_slew_ppm = ADJTIME_SLEW_PPM;
+slew_t global_slew = { false, 0, 0, 0, 0, 0 };
+unsigned int global_backward_step_policy = BACKWARD_STEP_NEVER;
+/* CLOCK_MONOTONIC_RAW time until which backward steps are allowed, or -1. */
+int64_t global_backward_step_window_end_mono_nsec = -1;
+/* Whether we last found something else disciplining the clock. */
+bool global_is_deferring_to_ntp = false;
+/* Set when we step the clock ourselves so that the clock change timer can tell our step from somebody else's.  The 
+   offset is CLOCK_REALTIME - CLOCK_MONOTONIC just after the step. */
+bool global_is_own_step_pending = false;
+int64_t global_own_step_offset_nsec = 0;
+/* SCHED_FIFO priority for the measurement window, or 0 to leave the scheduling alone. */
+int global_rt_priority = 0;
+/* CPU to pin ourselves to, or -1. */
+int global_cpu = -1;
+/* The scheduling we go back to after the measurement window. */
+int global_normal_sched_policy = SCHED_OTHER;
+struct sched_param global_normal_sched_param;
+delta_history_t global_delta_history;
+bool global_is_state_dirty = false;
+const char *global_metrics_file_name = NULL;
+const char *global_trace_file_name = NULL;
+trace_t global_trace = { 0, NULL, NULL };
+int global_measure_samples = MEASURE_SAMPLES;
+int global_measure_duration_sec = MEASURE_DURATION_SEC;
+bool global_is_measure_json = false;
+/* Whether to copy the system time to the RTC while NTP is keeping the system clock right. */
+bool global_is_rtc_write_back_enabled = false;
+
+static const double metrics_delta_bounds[METRICS_HISTOGRAM_BUCKETS] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5 };
+static const double metrics_latency_bounds[METRICS_HISTOGRAM_BUCKETS] = 
+        { 0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05 };
+static const double metrics_wait_bounds[METRICS_HISTOGRAM_BUCKETS] = { 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2, 5 };
+static const double metrics_count_bounds[METRICS_HISTOGRAM_BUCKETS] = { 1, 2, 5, 10, 20, 50, 100, 500 };
+#define METRICS_INITIALIZER { \
+    .abs_delta_seconds = { .bounds = metrics_delta_bounds }, \
+    .iteration_cpu_seconds = { .bounds = metrics_latency_bounds }, \
+    .iteration_syscalls = { .bounds = metrics_count_bounds } \
+}
+metrics_t global_metrics = METRICS_INITIALIZER;
+#define RTC_STATS_INITIALIZER { \
+    .read_seconds = { .bounds = metrics_latency_bounds }, \
+    .tick_wait_seconds = { .bounds = metrics_wait_bounds } \
+}
+/* Like global_rtc_phase. */
+__thread rtc_stats_t global_rtc_stats = RTC_STATS_INITIALIZER;
+measurement_thread_t global_measurement_thread = { .wake_fd = -1, .sample_fd = -1, 
+        .config_lock = PTHREAD_MUTEX_INITIALIZER, .owed_since_mono_nsec = -1 };
+
+
+static bool should_exit() {
+    return __atomic_load_n(&global_should_exit, __ATOMIC_RELAXED);
+}
+
+static int64_t sec_to_nsec(int64_t sec) {
+    return sec * NSEC_PER_SEC;
+}
+
+static int64_t msec_to_nsec(int64_t msec) {
+    return msec * 1000 * 1000;
+}
+
+static int64_t usec_to_nsec(int64_t usec) {
+    return usec * 1000;
+}
+
+/* Rounds towards minus infinity, so that the remainder is always positive like timeval and timespec want. */
+static int64_t nsec_to_sec(int64_t nsec) {
+    int64_t sec = nsec / NSEC_PER_SEC;
+    return ((nsec % NSEC_PER_SEC) < 0) ? (sec - 1) : sec;
+}
+
+/* Rounds towards minus infinity too, so that eg -1 nsec is -1 usec rather than 0. */
+static int64_t nsec_to_usec(int64_t nsec) {
+    int64_t usec = nsec / 1000;
+    return ((nsec % 1000) < 0) ? (usec - 1) : usec;
+}
+
+static double nsec_to_seconds(int64_t nsec) {
+    return ((double)nsec) / NSEC_PER_SEC;
+}
+
+static double adjtimex_freq_to_ppm(long freq) {
+    return ((double)freq) / ADJTIMEX_FREQ_SCALE;
+}
+
+/* The kernel's tick length in usec when nobody has adjusted it. */
+static long get_base_tick() {
+    long user_hz = sysconf(_SC_CLK_TCK);
+    return 1000 * 1000 / ((user_hz > 0) ? user_hz : 100);
+}
 
+static void histogram_observe(histogram_t *histogram, double value) {
+    assert(histogram);
 
-static int64_t sec_to_usec(int64_t sec) {
-    return sec * 1000 * 1000;
+    int i;
+    for (i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        if (value <= histogram->bounds[i]) {
+            break;
+        }
+    }
+
+    histogram->counts[i]++;
+    histogram->sum += value;
+    histogram->count++;
 }
 
-static int64_t usec_to_sec(int64_t usec) {
-    return (usec / 1000) / 1000;
+/* Atomic because both threads make syscalls. */
+static void count_syscall() {
+    __atomic_add_fetch(&global_metrics.syscalls, 1, __ATOMIC_RELAXED);
 }
 
+static uint64_t get_syscalls() {
+    return __atomic_load_n(&global_metrics.syscalls, __ATOMIC_RELAXED);
+}
 
 static const char *get_log_time() {
     struct timeval tv;
@@ -172,9 +917,25 @@ static void rtc_time_to_tm(const struct rtc_time *rtc, struct tm *tm) {
     tm->tm_yday = rtc->tm_yday;
 }
 
-static int tm_to_epoch_usec(struct tm *tm, int64_t *epoch_usec) {
+static void epoch_sec_to_rtc_time(time_t epoch_sec, struct rtc_time *rtc) {
+    assert(rtc);
+
+    struct tm tm;
+    gmtime_r(&epoch_sec, &tm);
+    memset(rtc, 0, sizeof(*rtc));
+    rtc->tm_sec = tm.tm_sec;
+    rtc->tm_min = tm.tm_min;
+    rtc->tm_hour = tm.tm_hour;
+    rtc->tm_mday = tm.tm_mday;
+    rtc->tm_mon = tm.tm_mon;
+    rtc->tm_year = tm.tm_year;
+    rtc->tm_wday = tm.tm_wday;
+    rtc->tm_yday = tm.tm_yday;
+}
+
+static int tm_to_epoch_nsec(struct tm *tm, int64_t *epoch_nsec) {
     assert(tm);
-    assert(epoch_usec);
+    assert(epoch_nsec);
 
     time_t epoch_sec;
 
@@ -187,399 +948,3665 @@ static int tm_to_epoch_usec(struct tm *tm, int64_t *epoch_usec) {
         return -1;
     }
 
-    *epoch_usec = sec_to_usec(epoch_sec);
+    *epoch_nsec = sec_to_nsec(epoch_sec);
     return 0;
 }
 
-static int64_t tv_to_epoch_usec(const struct timeval *tv) {
+static int64_t tv_to_epoch_nsec(const struct timeval *tv) {
     assert(tv);
-    int64_t epoch_usec = sec_to_usec(tv->tv_sec);
-    epoch_usec += tv->tv_usec;
-    return epoch_usec;
+    return sec_to_nsec(tv->tv_sec) + usec_to_nsec(tv->tv_usec);
 }
 
-static void epoch_usec_to_tv(const int64_t epoch_usec, struct timeval *tv) {
+/* timeval only goes down to usec so this loses the rest, rounding towards minus infinity. */
+static void epoch_nsec_to_tv(const int64_t epoch_nsec, struct timeval *tv) {
     assert(tv);
-    tv->tv_sec = usec_to_sec(epoch_usec);
-    tv->tv_usec = epoch_usec - sec_to_usec(tv->tv_sec);
+    tv->tv_sec = nsec_to_sec(epoch_nsec);
+    tv->tv_usec = nsec_to_usec(epoch_nsec - sec_to_nsec(tv->tv_sec));
 }
 
-static int enable_rtc_tick_interrupt(int fd) {
-    LOG_WRITE_VERBOSE_NARG("enable_rtc_tick_interrupt");
-    if (ioctl(fd, RTC_UIE_ON, 0) == -1) {
-        LOG_WRITE_ERROR("Unable to turn on clock tick interrupts via ioctl(%s)", "RTC_UIE_ON");
-        return -1;
-    }
+static int64_t ts_to_nsec(const struct timespec *ts) {
+    assert(ts);
+    return sec_to_nsec(ts->tv_sec) + ts->tv_nsec;
+}
 
-    return 0;
+/* Normalises so that tv_nsec is in [0, 1 sec), eg -1.5 sec is -2 sec plus 0.5 sec. */
+static void nsec_to_ts(int64_t nsec, struct timespec *ts) {
+    assert(ts);
+    ts->tv_sec = nsec_to_sec(nsec);
+    ts->tv_nsec = nsec - sec_to_nsec(ts->tv_sec);
 }
 
-static void disable_rtc_tick_interrupt(int fd) {
-    LOG_WRITE_VERBOSE_NARG("disable_rtc_tick_interrupt");
-    if (ioctl(fd, RTC_UIE_OFF, 0) == -1) {
-        LOG_WRITE_ERROR("Unable to turn off clock tick interrupts via ioctl(%s)", "RTC_UIE_OFF");
-    }
+/* The real clocks.  Each of these behaves like the syscall it wraps, including setting errno. */
+static int linux_open_rtc() {
+    global_rtc_fd = open_ro(global_config.rtc_device_name);
+    return (global_rtc_fd < 0) ? -1 : 0;
 }
 
-static int open_rtc() {
-    if (-1 != global_rtc_fd) {
-        return global_rtc_fd;
-    }
+static void linux_close_rtc() {
+    close(global_rtc_fd);
+    global_rtc_fd = -1;
+}
 
-    global_rtc_fd = open_ro("/dev/rtc0");
-    if (global_rtc_fd < 0) {
-        return global_rtc_fd;
-    }
+static int linux_set_rtc_tick_interrupt(bool is_enabled) {
+    return ioctl(global_rtc_fd, is_enabled ? RTC_UIE_ON : RTC_UIE_OFF, 0);
+}
 
-    if (enable_rtc_tick_interrupt(global_rtc_fd) != 0) {
-        close(global_rtc_fd);
-        global_rtc_fd = -1;
-    }
+static int linux_read_rtc(struct rtc_time *time) {
+    return ioctl(global_rtc_fd, RTC_RD_TIME, time);
+}
 
-    return global_rtc_fd;
+/* Needs CAP_SYS_TIME but not a writable fd. */
+static int linux_set_rtc(const struct rtc_time *time) {
+    return ioctl(global_rtc_fd, RTC_SET_TIME, time);
 }
 
-static void close_rtc() {
-    if (-1 != global_rtc_fd) {
-        disable_rtc_tick_interrupt(global_rtc_fd);
-        close(global_rtc_fd);
-        global_rtc_fd = -1;
-    }
+static int linux_wait_for_rtc_interrupt(int64_t timeout_nsec) {
+    fd_set rtc_fds;
+    FD_ZERO(&rtc_fds);
+    FD_SET(global_rtc_fd, &rtc_fds);
+
+    struct timespec ts;
+    nsec_to_ts(timeout_nsec, &ts);
+    return pselect(global_rtc_fd + 1, &rtc_fds, NULL, NULL, &ts, NULL);
 }
 
-static int read_rtc(struct rtc_time *time) {
-    assert(time);
+static int linux_read_rtc_interrupt(unsigned long *interrupt_info) {
+    return (read(global_rtc_fd, interrupt_info, sizeof(*interrupt_info)) == sizeof(*interrupt_info)) ? 0 : -1;
+}
 
-    int fd = open_rtc();
-    if (fd < 0) {
+static int linux_get_monotonic_now(int64_t *mono_nsec) {
+    /* CLOCK_MONOTONIC_RAW isn't slewed by adjtime() so it tracks the RTC oscillator without our own adjustments 
+       getting in the way. */
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0) {
         return -1;
     }
 
-    int rc = ioctl(fd, RTC_RD_TIME, time);
-    if (-1 == rc) {
-        LOG_WRITE_ERROR("Unable to read RTC via ioctl(%s)", "RTC_RD_TIME");
+    *mono_nsec = ts_to_nsec(&ts);
+    return 0;
+}
+
+static int linux_get_system_now(int64_t *epoch_nsec) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
         return -1;
-    }    
+    }
 
+    *epoch_nsec = ts_to_nsec(&ts);
     return 0;
 }
 
-static int read_rtc_as_epoch_usec(int64_t *epoch_usec) {
-    LOG_WRITE_VERBOSE_NARG("read_rtc_as_epoch");
+static void linux_sleep_nsec(int64_t nsec) {
+    struct timespec ts;
+    nsec_to_ts(nsec, &ts);
+    nanosleep(&ts, NULL);
+}
 
-    assert(epoch_usec);
+/* The clock_name of PTP clocks that tell the hypervisor host's time, from the Hyper-V, KVM and VMware drivers.  A NIC's 
+   PTP clock could say anything so we only use one of those if we're told to. */
+static const char *const ptp_host_clock_names[] = { "hyperv", "KVM virtual PTP", "ptp_vmw" };
+
+static int linux_find_ptp(char *device_name, size_t size) {
+    int i;
+    for (i = 0; i < PTP_MAX_DEVICES; i++) {
+        char file_name[64];
+        snprintf(file_name, sizeof(file_name), "/sys/class/ptp/ptp%d/clock_name", i);
+        FILE *fp = fopen(file_name, "r");
+        if (!fp) {
+            continue;
+        }
 
-    struct rtc_time rtct;
-    if (read_rtc(&rtct) != 0) {
-        return -1;
-    }
+        char clock_name[64] = { '\0' };
+        bool is_read = fgets(clock_name, sizeof(clock_name), fp) != NULL;
+        fclose(fp);
+        if (!is_read) {
+            continue;
+        }
 
-    struct tm tm;
-    rtc_time_to_tm(&rtct, &tm);
-    if (tm_to_epoch_usec(&tm, epoch_usec) != 0) {
-        return -1;
+        clock_name[strcspn(clock_name, "\n")] = '\0';
+        size_t j;
+        for (j = 0; j < (sizeof(ptp_host_clock_names) / sizeof(ptp_host_clock_names[0])); j++) {
+            if (strcmp(clock_name, ptp_host_clock_names[j]) == 0) {
+                snprintf(device_name, size, "/dev/ptp%d", i);
+                return 0;
+            }
+        }
     }
 
-    return 0;
+    return 1;
 }
 
-/* Returns zero on success, positive on timeout, negative on other error. */
-static int select_on_rtc(int fd) {
-    fd_set rtc_fds;
-    FD_ZERO(&rtc_fds);
-    FD_SET(fd, &rtc_fds);
-
-    struct timeval tv;    
-    const time_t timeout_sec = 10;
-    tv.tv_sec = timeout_sec;
-    tv.tv_usec = 0;
-    int rc = select(fd + 1, &rtc_fds, NULL, NULL, &tv);
-    
-    if (global_should_exit) {
-        LOG_WRITE_INFO_NARG("select() interrupted by signal, will exit ASAP");
-        return -1;
-    }
+static int linux_open_ptp(const char *device_name) {
+    global_ptp_fd = open_ro(device_name);
+    return (global_ptp_fd < 0) ? -1 : 0;
+}
 
-    if (0 == rc) {
-        /* Really this should be an ERROR log but this happens once every few minutes on my WSL2 system.  Far from 
-           ideal but as we take no action for small deltas it should be ok to just plough on. */
-        LOG_WRITE_VERBOSE("Waiting for clock tick interrupt timed out.  timeout=%lld seconds", 
-                ((long long)timeout_sec));
-        return 1;
-    } 
-    
-    if (rc < 0) {
-        LOG_WRITE_ERROR("Waiting for clock tick interrupt failed.  timeout=%lld seconds", ((long long)timeout_sec));
-        return -1;
-    } 
+static void linux_close_ptp() {
+    close(global_ptp_fd);
+    global_ptp_fd = -1;
+}
 
-    return 0;
+static int linux_ptp_ioctl(unsigned long request, void *arg) {
+    return ioctl(global_ptp_fd, request, arg);
 }
 
-static int read_interrupt_info_from_rtc(int fd) {
-    LOG_WRITE_VERBOSE_NARG("About to read() on RTC");
-    unsigned long interrupt_info;
-    if (read(fd, &interrupt_info, sizeof(interrupt_info)) != sizeof(interrupt_info)) {
-        LOG_WRITE_ERROR_NARG("read() on RTC failed");
-        return -1;
-    } 
+static const clock_backend_t linux_clock_backend = {
+    .name = "linux",
+    .open_rtc = linux_open_rtc,
+    .close_rtc = linux_close_rtc,
+    .set_rtc_tick_interrupt = linux_set_rtc_tick_interrupt,
+    .read_rtc = linux_read_rtc,
+    .set_rtc = linux_set_rtc,
+    .wait_for_rtc_interrupt = linux_wait_for_rtc_interrupt,
+    .read_rtc_interrupt = linux_read_rtc_interrupt,
+    .get_monotonic_now = linux_get_monotonic_now,
+    .get_system_now = linux_get_system_now,
+    .clock_gettime = clock_gettime,
+    .sleep_nsec = linux_sleep_nsec,
+    .adjtime = adjtime,
+    .clock_adjtime = clock_adjtime,
+    .find_ptp = linux_find_ptp,
+    .open_ptp = linux_open_ptp,
+    .close_ptp = linux_close_ptp,
+    .ptp_ioctl = linux_ptp_ioctl
+};
+
+static uint64_t sim_random() {
+    /* xorshift64*, which is plenty for jitter and dropped interrupts, and gives the same run every time. */
+    sim_t *sim = &global_sim;
+    sim->random_state ^= sim->random_state >> 12;
+    sim->random_state ^= sim->random_state << 25;
+    sim->random_state ^= sim->random_state >> 27;
+    return sim->random_state * 0x2545f4914f6cdd1dULL;
+}
 
-    /* Least significant byte contains the interrupt that fired. */
-    uint8_t interrupt = (uint8_t)interrupt_info;
-    LOG_WRITE_VERBOSE("read() on RTC returned interrupt bitmask=0x%02x", (unsigned int)interrupt);
-    return 0;
+/* Uniform in [0, 1). */
+static double sim_random_fraction() {
+    return ((double)(sim_random() >> 11)) / ((double)(1ULL << 53));
 }
-    
 
-/* The hardware clock has a granularity of 1 second so we need to wait for the second to tick over before trying to do 
-   anything, so we can be as accurate as possible.  Returns 0 on success, >0 on timeout, <0 on other error. */
-static int wait_for_rtc_tick() {
-    LOG_WRITE_VERBOSE_NARG("wait_for_rtc_tick");
+static int64_t sim_round(double nsec) {
+    return (int64_t)((nsec < 0) ? (nsec - 0.5) : (nsec + 0.5));
+}
 
-    LOG_WRITE_VERBOSE_NARG("opening RTC");
-    int fd = open_rtc();
-    if (fd < 0) {
-        return -1;
+static void sim_advance_rtc(double true_nsec) {
+    sim_t *sim = &global_sim;
+    int64_t before_sec = (int64_t)floor(sim->rtc_nsec / NSEC_PER_SEC);
+    sim->rtc_nsec += true_nsec * (1 + (sim->scenario->rtc_drift_ppm / (1000 * 1000)));
+    if (sim->is_tick_interrupt_enabled && ((int64_t)floor(sim->rtc_nsec / NSEC_PER_SEC) > before_sec)) {
+        sim->is_tick_pending = true;
+        sim->tick_interrupts++;
     }
+}
 
-    LOG_WRITE_VERBOSE_NARG("selecting on RTC");
-    int rc = select_on_rtc(fd);
-    if (0 == rc) {
-        /* We need to read() from the RTC fd after select()ing to reset it so the select() will wait next time. */
-        rc = read_interrupt_info_from_rtc(fd);
+static void sim_advance_running(double true_nsec) {
+    sim_t *sim = &global_sim;
+    const double sys_drift_ppm = sim->scenario->sys_drift_ppm;
+    sim->true_nsec += true_nsec;
+    sim->mono_nsec += true_nsec * (1 + (sys_drift_ppm / (1000 * 1000)));
+    double tick_ppm = ((double)(sim->tick - get_base_tick()) * 1000 * 1000) / get_base_tick();
+    sim->sys_nsec += true_nsec * (1 + ((sys_drift_ppm + adjtimex_freq_to_ppm(sim->freq) + tick_ppm) / (1000 * 1000)));
+
+    double max_slew_nsec = (true_nsec * SIM_SLEW_PPM) / (1000 * 1000);
+    double slew_nsec = sim->adjtime_pending_nsec;
+    if (slew_nsec > max_slew_nsec) {
+        slew_nsec = max_slew_nsec;
+    } else if (slew_nsec < -max_slew_nsec) {
+        slew_nsec = -max_slew_nsec;
     }
 
-    LOG_WRITE_VERBOSE_NARG("wait_for_rtc_tick end");
-    return rc;
+    sim->sys_nsec += slew_nsec;
+    sim->adjtime_pending_nsec -= slew_nsec;
+    sim_advance_rtc(true_nsec);
+    if (sim->true_nsec < sec_to_nsec(sim->scenario->ntp_sec)) {
+        sim->sys_nsec = sim->rtc_nsec;
+        sim->adjtime_pending_nsec = 0;
+    }
 }
 
-/* Returns 0 on success, >0 if we timed out waiting for the RTC but still read the time, <0 on other error. */
-static int get_hardware_now(int64_t *epoch_usec) {
-    LOG_WRITE_VERBOSE_NARG("get_hardware_now");
+/* Moves true time on, pausing the VM along the way if a pause is due. */
+static void sim_advance(double true_nsec) {
+    sim_t *sim = &global_sim;
+    const sim_scenario_t *scenario = sim->scenario;
+    while (true_nsec > 0) {
+        bool is_pause_due = (scenario->pause_interval_sec > 0) && 
+                ((sim->true_nsec + true_nsec) >= sim->next_pause_true_nsec);
+        double step_nsec = is_pause_due ? (sim->next_pause_true_nsec - sim->true_nsec) : true_nsec;
+        sim_advance_running(step_nsec);
+        true_nsec -= step_nsec;
+        if (is_pause_due) {
+            /* Only the RTC keeps going while the VM is paused, and nothing in the guest notices. */
+            double pause_nsec = sec_to_nsec(scenario->pause_sec);
+            sim->true_nsec += pause_nsec;
+            sim_advance_rtc(pause_nsec);
+            sim->next_pause_true_nsec += sec_to_nsec(scenario->pause_interval_sec);
+        }
+    }
+}
 
-    assert(epoch_usec);
+static double sim_true_nsec_to_next_edge() {
+    const sim_t *sim = &global_sim;
+    double rtc_nsec_to_edge = sec_to_nsec((int64_t)floor(sim->rtc_nsec / NSEC_PER_SEC) + 1) - sim->rtc_nsec;
+    return rtc_nsec_to_edge / (1 + (sim->scenario->rtc_drift_ppm / (1000 * 1000)));
+}
 
-    int wait_rc = wait_for_rtc_tick();
-    if (wait_rc < 0) {
-        return -1;
-    }
+static int sim_open_rtc() {
+    return 0;
+}
 
-    if (wait_rc > 0) {
-        /* This should really be an INFO but it happens a lot on my WSL2 system and we don't react to small deltas. 
-           We need to read the clock anyway because a big change might be required- this happens more often after
-           waking from some kind of suspend. */
-        LOG_WRITE_VERBOSE_NARG("Waiting for RTC timed out but we will read the clock now anyway");
-    }
+static void sim_close_rtc() {
+}
 
-    int read_rc = read_rtc_as_epoch_usec(epoch_usec);
-    if (read_rc != 0) {
-        return -1;
-    }
+static int sim_set_rtc_tick_interrupt(bool is_enabled) {
+    global_sim.is_tick_interrupt_enabled = is_enabled;
+    global_sim.is_tick_pending = false;
+    return 0;
+}
 
-    return wait_rc;
+static int sim_read_rtc(struct rtc_time *time) {
+    sim_t *sim = &global_sim;
+    double read_nsec = SIM_RTC_READ_NSEC + (sim_random_fraction() * sim->scenario->rtc_read_jitter_nsec);
+    double latch_nsec = sim_random_fraction() * read_nsec;
+    sim_advance(latch_nsec);
+    time_t rtc_sec = SIM_EPOCH_SEC + (time_t)floor(sim->rtc_nsec / NSEC_PER_SEC);
+    sim_advance(read_nsec - latch_nsec);
+    epoch_sec_to_rtc_time(rtc_sec, time);
+    return 0;
 }
- 
-static int get_system_now(int64_t *epoch_usec) {
-    LOG_WRITE_VERBOSE_NARG("get_system_now");
 
-    struct timeval tv;
-    if (gettimeofday(&tv, NULL) != 0) {
-        LOG_WRITE_ERROR_NARG("gettimeofday failed");
+/* Like a real RTC the next second starts RTC_SET_DELAY_NSEC later. */
+static int sim_set_rtc(const struct rtc_time *time) {
+    sim_t *sim = &global_sim;
+    struct tm tm;
+    int64_t epoch_nsec = -1;
+    rtc_time_to_tm(time, &tm);
+    if (tm_to_epoch_nsec(&tm, &epoch_nsec) != 0) {
+        errno = EINVAL;
         return -1;
     }
 
-    *epoch_usec = tv_to_epoch_usec(&tv);
+    sim_advance(SIM_RTC_READ_NSEC);
+    sim->rtc_nsec = (epoch_nsec - sec_to_nsec(SIM_EPOCH_SEC)) + (NSEC_PER_SEC - RTC_SET_DELAY_NSEC);
+    sim->is_tick_pending = false;
     return 0;
 }
- 
-/* Returns 0 on success, >0 if we timed out waiting for the RTC but still read the times, <0 on other error. */
-static int get_times(int64_t *hw, int64_t *sys) {
-    LOG_WRITE_VERBOSE_NARG("get_times");
 
-    assert(hw);
-    assert(sys);
+static int sim_wait_for_rtc_interrupt(int64_t timeout_nsec) {
+    sim_t *sim = &global_sim;
+    const sim_scenario_t *scenario = sim->scenario;
+    if (sim->is_tick_pending) {
+        return 1;
+    }
 
-    /* This function is extremely time-sensitive.  We need to get the system time ASAP after getting the hardware time.
-       Don't be tempted to get the system time first because we need to wait for the hardware clock to tick. */
+    double waited_nsec = 0;
+    while (sim->is_tick_interrupt_enabled) {
+        bool is_dropped = sim_random_fraction() < scenario->tick_drop_probability;
+        double latency_nsec = scenario->tick_latency_min_nsec + 
+                (sim_random_fraction() * (scenario->tick_latency_max_nsec - scenario->tick_latency_min_nsec));
+        /* Aim just past the edge so that rounding can't leave us on the wrong side of it. */
+        double arrival_nsec = sim_true_nsec_to_next_edge() + 1 + (is_dropped ? 0 : latency_nsec);
+        if ((waited_nsec + arrival_nsec) > timeout_nsec) {
+            break;
+        }
 
-    int64_t tmp_hw = -1;
-    int64_t tmp_sys = -1;
+        sim_advance(arrival_nsec);
+        waited_nsec += arrival_nsec;
+        if (!is_dropped) {
+            return 1;
+        }
 
-    int hw_rc = get_hardware_now(&tmp_hw);
-    if (hw_rc < 0) {
-        return -1;
+        sim->is_tick_pending = false;
     }
 
-    if (get_system_now(&tmp_sys) != 0) {
-        return -1;
-    }
+    sim_advance(timeout_nsec - waited_nsec);
+    return 0;
+}
 
-    LOG_WRITE_VERBOSE("get_times: hw=%" USEC_FMT " sys=%" USEC_FMT " hw_rc=%d", tmp_hw, tmp_sys, hw_rc);
+static int sim_read_rtc_interrupt(unsigned long *interrupt_info) {
+    global_sim.is_tick_pending = false;
+    *interrupt_info = RTC_UF;
+    return 0;
+}
 
-    *hw = tmp_hw;
-    *sys = tmp_sys;
-    return hw_rc;
+static int sim_get_monotonic_now(int64_t *mono_nsec) {
+    sim_advance(SIM_CLOCK_READ_NSEC);
+    *mono_nsec = sim_round(global_sim.mono_nsec);
+    return 0;
 }
 
-static int64_t calculate_delta(int64_t hw_time, int64_t sys_time) {
-    return hw_time - sys_time;
+static int sim_get_system_now(int64_t *epoch_nsec) {
+    sim_advance(SIM_CLOCK_READ_NSEC);
+    *epoch_nsec = sec_to_nsec(SIM_EPOCH_SEC) + sim_round(global_sim.sys_nsec);
+    return 0;
 }
 
-/* Returns 0 on success, >0 if we timed out waiting for the RTC but still read the times, <0 on other error. */
-static int get_delta(int64_t *delta) {
-    assert(delta);
+static int sim_clock_gettime(clockid_t clock_id, struct timespec *ts) {
+    sim_advance(SIM_CLOCK_READ_NSEC);
+    const sim_t *sim = &global_sim;
+    int64_t nsec = 0;
+    switch (clock_id) {
+        case CLOCK_REALTIME:
+            nsec = sec_to_nsec(SIM_EPOCH_SEC) + sim_round(sim->sys_nsec);
+            break;
 
-    int64_t hw_now;
-    int64_t sys_now;
+        /* Nothing in the guest notices a VM pause, so it's never suspended. */
+        case CLOCK_MONOTONIC:
+        case CLOCK_BOOTTIME:
+            nsec = sim_round(sim->sys_nsec - sim->stepped_nsec);
+            break;
 
-    int rc = get_times(&hw_now, &sys_now);
-    if (rc < 0) {
-        return -1;
+        case CLOCK_MONOTONIC_RAW:
+            nsec = sim_round(sim->mono_nsec);
+            break;
+
+        default:
+            errno = EINVAL;
+            return -1;
     }
 
-    *delta = calculate_delta(hw_now, sys_now);
-    return rc;
+    nsec_to_ts(nsec, ts);
+    return 0;
 }
 
+static void sim_sleep_nsec(int64_t nsec) {
+    sim_advance(nsec);
+}
 
-static int get_current_time_adjustment_delta(int64_t *current_delta) {
-    LOG_WRITE_VERBOSE_NARG("get_current_time_adjustment_delta");
+static int sim_adjtime(const struct timeval *delta, struct timeval *old_delta) {
+    sim_t *sim = &global_sim;
+    if (old_delta) {
+        epoch_nsec_to_tv(sim_round(sim->adjtime_pending_nsec), old_delta);
+    }
 
-    assert(current_delta);
-    /* There's an old bug where adjtime(NULL &old) would not set old.  We're super-unlikely to encounter it because 
-       it's back in Linux 2.6 so old but just in case we'll set old to a big value. */
-    struct timeval old = { .tv_sec = LONG_MAX, .tv_usec = 0 };
-    if (adjtime(NULL, &old) != 0) {
-        LOG_WRITE_ERROR_NARG("Unable to get current adjtime delta");
-        return -1;
+    if (delta) {
+        sim->adjtime_pending_nsec = tv_to_epoch_nsec(delta);
     }
 
-    *current_delta = tv_to_epoch_usec(&old);
-    LOG_WRITE_VERBOSE("current_adjtime_delta=%" USEC_FMT, *current_delta);
     return 0;
 }
 
+static int sim_clock_adjtime(clockid_t clock_id, struct timex *tx) {
+    sim_t *sim = &global_sim;
+    if (CLOCK_REALTIME != clock_id) {
+        errno = EINVAL;
+        return -1;
+    }
 
-static int polite_set_time(int64_t delta) {
-    LOG_WRITE_VERBOSE("polite_set_time, delta=%" USEC_FMT, delta);
-
-    if (0 == delta) {
-        LOG_WRITE_VERBOSE_NARG("0 == delta");
-    } else {
-        struct timeval old = { 0, 0 };
-        struct timeval tv;
-        epoch_usec_to_tv(delta, &tv);
-        if (adjtime(&tv, &old) != 0) {
-            LOG_WRITE_ERROR("Unable to adjust time politely.  delta=%" USEC_FMT " usec", delta);
+    if (tx->modes & ADJ_SETOFFSET) {
+        /* The kernel wants the sub-second part normalised to be positive. */
+        int64_t fraction_nsec = (tx->modes & ADJ_NANO) ? tx->time.tv_usec : usec_to_nsec(tx->time.tv_usec);
+        if ((fraction_nsec < 0) || (fraction_nsec >= NSEC_PER_SEC)) {
+            errno = EINVAL;
             return -1;
         }
 
-        LOG_WRITE_INFO("Time is adjusting politely.  delta=%" USEC_FMT " usec  old=%" USEC_FMT " usec", 
-                delta, tv_to_epoch_usec(&old));
+        sim->sys_nsec += sec_to_nsec(tx->time.tv_sec) + fraction_nsec;
+        sim->stepped_nsec += sec_to_nsec(tx->time.tv_sec) + fraction_nsec;
+        sim->is_clock_set = true;
+        sim->backward_steps += (tx->time.tv_sec < 0) ? 1 : 0;
+        /* Stepping the clock cancels any adjtime() in progress. */
+        sim->adjtime_pending_nsec = 0;
     }
 
-    return 0;
-}
+    if (tx->modes & ADJ_FREQUENCY) {
+        /* The kernel clamps rather than refusing. */
+        const long max_freq = (long)FREQ_MAX_PPM * ADJTIMEX_FREQ_SCALE;
+        sim->freq = (tx->freq > max_freq) ? max_freq : ((tx->freq < -max_freq) ? -max_freq : tx->freq);
+    }
 
-static int impolite_set_time(int64_t delta) {
-    LOG_WRITE_VERBOSE_NARG("impolite_set_time");
+    if (tx->modes & ADJ_TICK) {
+        if ((tx->tick < ((get_base_tick() * 9) / 10)) || (tx->tick > ((get_base_tick() * 11) / 10))) {
+            errno = EINVAL;
+            return -1;
+        }
 
-    int64_t sys_now;
+        sim->tick = tx->tick;
+    }
 
-    if (delta < 0) {
-        LOG_WRITE_ERROR("delta=%" USEC_FMT " usec, will not step the clock backwards.  Reboot recommended.", delta);
-        return -1;
-    } 
+    if (tx->modes & ADJ_STATUS) {
+        sim->status = tx->status;
+    }
 
-   if (get_system_now(&sys_now) < 0) {
-        return -1;
+    if (tx->modes & ADJ_NANO) {
+        sim->status |= STA_NANO;
     }
 
-    int64_t target_now = sys_now + delta;
+    if (tx->modes & ADJ_MICRO) {
+        sim->status &= ~STA_NANO;
+    }
 
-    struct timeval tv;
-    epoch_usec_to_tv(target_now, &tv);
-    if (settimeofday(&tv, NULL) != 0) {
-        LOG_WRITE_ERROR("Unable to set time impolitely.  delta=%" USEC_FMT " usec", delta);
-        return -1;
+    /* Like the kernel, the maximum error grows by 500 ppm from when NTP stopped updating it. */
+    double ntp_stopped_nsec = sim->true_nsec - sec_to_nsec(sim->scenario->ntp_sec);
+    tx->maxerror = (ntp_stopped_nsec > 0) ? nsec_to_usec((int64_t)ntp_stopped_nsec / 2000) : 0;
+    if (tx->maxerror >= sec_to_nsec(NTP_PHASE_LIMIT_SEC) / 1000) {
+        sim->status |= STA_UNSYNC;
     }
 
-    LOG_WRITE_INFO("Adjusted time impolitely.  delta=%" USEC_FMT " usec", delta);
-    return 0;
+    tx->status = sim->status;
+    tx->freq = sim->freq;
+    tx->tick = sim->tick;
+    return (sim->status & STA_UNSYNC) ? TIME_ERROR : TIME_OK;
 }
 
-static bool has_same_sign(int64_t one, int64_t two) {
-    if ((0 == one) && (0 == two)) {
-        return true;
+static int sim_find_ptp(char *device_name, size_t size) {
+    if (0 == global_sim.scenario->ptp_read_nsec) {
+        return 1;
     }
 
-    if ((one > 0) && (two > 0)) {
-       return true;
-    }
-   
-    if  ((one < 0) && (two < 0)) {
-        return true;
+    snprintf(device_name, size, "sim-ptp0");
+    return 0;
+}
+
+static int sim_open_ptp(const char *device_name) {
+    (void)device_name;
+    if (0 == global_sim.scenario->ptp_read_nsec) {
+        errno = ENOENT;
+        return -1;
     }
 
-    return false;
+    return 0;
 }
 
-static int64_t max_polite_adjustment_delta_usec() {
-    return sec_to_usec(MAX_POLITE_ADJUSTMENT_DELTA_SEC);
+static void sim_close_ptp() {
 }
 
-static int set_time() {
-    LOG_WRITE_VERBOSE_NARG("set_time");
+static void sim_nsec_to_ptp_clock_time(double nsec, struct ptp_clock_time *t) {
+    struct timespec ts;
+    nsec_to_ts(sim_round(nsec), &ts);
+    memset(t, 0, sizeof(*t));
+    t->sec = SIM_EPOCH_SEC + ts.tv_sec;
+    t->nsec = (uint32_t)ts.tv_nsec;
+}
 
-    int64_t delta;
-    int delta_rc = get_delta(&delta);
-    if (delta_rc < 0) {
+static int sim_ptp_ioctl(unsigned long request, void *arg) {
+    sim_t *sim = &global_sim;
+    if (PTP_SYS_OFFSET != request) {
+        errno = EOPNOTSUPP;
         return -1;
     }
 
-    if (llabs(delta) < sec_to_usec(MIN_ADJUSTMENT_DELTA_SEC)) {
-        LOG_WRITE_VERBOSE("No work to do, delta=%" USEC_FMT " which is less than threshold=%" USEC_FMT " delta_rc=%d", 
-                delta, sec_to_usec(MIN_ADJUSTMENT_DELTA_SEC), delta_rc);
-        return 0;
-    }
-
-    int64_t current_adjtime_delta = INT64_MAX;
-    if (get_current_time_adjustment_delta(&current_adjtime_delta) != 0) {
+    struct ptp_sys_offset *offset = (struct ptp_sys_offset *)arg;
+    if ((0 == offset->n_samples) || (offset->n_samples > PTP_MAX_SAMPLES)) {
+        errno = EINVAL;
         return -1;
     }
 
-    if (has_same_sign(delta, current_adjtime_delta) && (llabs(delta) <= max_polite_adjustment_delta_usec())) {
-        LOG_WRITE_VERBOSE("delta_rc=%d delta=%" USEC_FMT " current_adjtime_delta=%" USEC_FMT
-                        ", they have the same sign & delta is within the polite adjustment limit, no action required", 
-                    delta_rc, delta, current_adjtime_delta);
-        return 0;
+    unsigned int i;
+    for (i = 0; i < offset->n_samples; i++) {
+        sim_advance(SIM_CLOCK_READ_NSEC);
+        sim_nsec_to_ptp_clock_time(sim->sys_nsec, &offset->ts[2 * i]);
+        double read_nsec = sim->scenario->ptp_read_nsec * (1 + sim_random_fraction());
+        double latch_nsec = sim_random_fraction() * read_nsec;
+        sim_advance(latch_nsec);
+        sim_nsec_to_ptp_clock_time(sim->rtc_nsec, &offset->ts[(2 * i) + 1]);
+        sim_advance(read_nsec - latch_nsec);
     }
 
-    LOG_WRITE_VERBOSE("delta_rc=%d delta=%" USEC_FMT " usec max_polite_delta=%" USEC_FMT " usec", 
-            delta_rc, delta, max_polite_adjustment_delta_usec());
+    sim_advance(SIM_CLOCK_READ_NSEC);
+    sim_nsec_to_ptp_clock_time(sim->sys_nsec, &offset->ts[2 * offset->n_samples]);
+    return 0;
+}
 
-    int result = (llabs(delta) <= max_polite_adjustment_delta_usec()) ? polite_set_time(delta) : impolite_set_time(delta);
-    if ((0 == result) && global_is_verbose) {
-        LOG_WRITE_VERBOSE_NARG("set_time: success.  Will re-get times for the log");
-        int64_t hw_now;
-        int64_t sys_now;
-        get_times(&hw_now, &sys_now);
+static const clock_backend_t sim_clock_backend = {
+    .name = "simulated",
+    .open_rtc = sim_open_rtc,
+    .close_rtc = sim_close_rtc,
+    .set_rtc_tick_interrupt = sim_set_rtc_tick_interrupt,
+    .read_rtc = sim_read_rtc,
+    .set_rtc = sim_set_rtc,
+    .wait_for_rtc_interrupt = sim_wait_for_rtc_interrupt,
+    .read_rtc_interrupt = sim_read_rtc_interrupt,
+    .get_monotonic_now = sim_get_monotonic_now,
+    .get_system_now = sim_get_system_now,
+    .clock_gettime = sim_clock_gettime,
+    .sleep_nsec = sim_sleep_nsec,
+    .adjtime = sim_adjtime,
+    .clock_adjtime = sim_clock_adjtime,
+    .find_ptp = sim_find_ptp,
+    .open_ptp = sim_open_ptp,
+    .close_ptp = sim_close_ptp,
+    .ptp_ioctl = sim_ptp_ioctl
+};
+
+const clock_backend_t *global_backend = &linux_clock_backend;
+
+static int enable_rtc_tick_interrupt() {
+    LOG_WRITE_VERBOSE_NARG("enable_rtc_tick_interrupt");
+    count_syscall();
+    if (global_backend->set_rtc_tick_interrupt(true) == -1) {
+        LOG_WRITE_ERROR("Unable to turn on clock tick interrupts via ioctl(%s)", "RTC_UIE_ON");
+        return -1;
     }
 
-    return result;
+    global_is_rtc_tick_interrupt_enabled = true;
+    return 0;
 }
 
-static void write_pid_file() {
-    int fd = open(PID_FILE_NAME, O_CREAT|O_EXCL|O_RDWR, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-        LOG_WRITE_ERROR("Unable to open pid file %s", PID_FILE_NAME);
+static void disable_rtc_tick_interrupt() {
+    if (!global_is_rtc_tick_interrupt_enabled) {
         return;
-    } 
+    }
 
-    FILE *fp = fdopen(fd, "w");
-    if (!fp) {
-        LOG_WRITE_ERROR("Unable to fdopen pid file %s", PID_FILE_NAME);
-        close(fd);
+    LOG_WRITE_VERBOSE_NARG("disable_rtc_tick_interrupt");
+    count_syscall();
+    if (global_backend->set_rtc_tick_interrupt(false) == -1) {
+        LOG_WRITE_ERROR("Unable to turn off clock tick interrupts via ioctl(%s)", "RTC_UIE_OFF");
+    }
+
+    global_is_rtc_tick_interrupt_enabled = false;
+}
+
+static int open_rtc() {
+    if (global_is_rtc_open) {
+        return 0;
+    }
+
+    count_syscall();
+    int rc = global_backend->open_rtc();
+    PROBE1(rtc_open, rc);
+    if (rc != 0) {
+        return -1;
+    }
+
+    global_is_rtc_open = true;
+    return 0;
+}
+
+static void close_rtc() {
+    if (global_is_rtc_open) {
+        disable_rtc_tick_interrupt();
+        global_backend->close_rtc();
+        global_is_rtc_open = false;
+    }
+}
+
+static int read_rtc(struct rtc_time *time) {
+    assert(time);
+
+    if (open_rtc() != 0) {
+        return -1;
+    }
+
+    int64_t before_mono_nsec = 0;
+    int64_t after_mono_nsec = 0;
+    global_backend->get_monotonic_now(&before_mono_nsec);
+    count_syscall();
+    int rc = global_backend->read_rtc(time);
+    global_backend->get_monotonic_now(&after_mono_nsec);
+    PROBE3(rtc_read, rc, before_mono_nsec, after_mono_nsec);
+    histogram_observe(&global_rtc_stats.read_seconds, nsec_to_seconds(after_mono_nsec - before_mono_nsec));
+    if (-1 == rc) {
+        LOG_WRITE_ERROR("Unable to read RTC via ioctl(%s)", "RTC_RD_TIME");
+        return -1;
+    }    
+
+    return 0;
+}
+
+static int read_rtc_as_epoch_nsec(int64_t *epoch_nsec) {
+    LOG_WRITE_VERBOSE_NARG("read_rtc_as_epoch");
+
+    assert(epoch_nsec);
+
+    struct rtc_time rtct;
+    if (read_rtc(&rtct) != 0) {
+        return -1;
+    }
+
+    struct tm tm;
+    rtc_time_to_tm(&rtct, &tm);
+    if (tm_to_epoch_nsec(&tm, epoch_nsec) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int get_monotonic_now(int64_t *mono_nsec) {
+    assert(mono_nsec);
+
+    if (global_backend->get_monotonic_now(mono_nsec) != 0) {
+        LOG_WRITE_ERROR_NARG("clock_gettime(CLOCK_MONOTONIC_RAW) failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+static const char *ptp_method_to_string(ptp_method_t method) {
+    switch (method) {
+        case PTP_METHOD_NONE:
+            return "none";
+
+        case PTP_METHOD_PRECISE:
+            return "PTP_SYS_OFFSET_PRECISE";
+
+        case PTP_METHOD_EXTENDED:
+            return "PTP_SYS_OFFSET_EXTENDED";
+
+        case PTP_METHOD_BASIC:
+            return "PTP_SYS_OFFSET";
+    }
+
+    return "unknown";
+}
+
+static void close_ptp() {
+    if (PTP_METHOD_NONE != global_ptp_method) {
+        global_backend->close_ptp();
+        global_ptp_method = PTP_METHOD_NONE;
+    }
+}
+
+/* Works out the best way the PTP clock can be cross-timestamped.  Drivers only support some of them, eg Hyper-V only 
+   supports PTP_SYS_OFFSET. */
+static ptp_method_t probe_ptp_method() {
+    struct ptp_sys_offset_precise precise;
+    memset(&precise, 0, sizeof(precise));
+    count_syscall();
+    if (global_backend->ptp_ioctl(PTP_SYS_OFFSET_PRECISE, &precise) == 0) {
+        return PTP_METHOD_PRECISE;
+    }
+
+    struct ptp_sys_offset_extended extended;
+    memset(&extended, 0, sizeof(extended));
+    extended.n_samples = 1;
+    count_syscall();
+    if (global_backend->ptp_ioctl(PTP_SYS_OFFSET_EXTENDED, &extended) == 0) {
+        return PTP_METHOD_EXTENDED;
+    }
+
+    struct ptp_sys_offset basic;
+    memset(&basic, 0, sizeof(basic));
+    basic.n_samples = 1;
+    count_syscall();
+    if (global_backend->ptp_ioctl(PTP_SYS_OFFSET, &basic) == 0) {
+        return PTP_METHOD_BASIC;
+    }
+
+    return PTP_METHOD_NONE;
+}
+
+/* Opens the PTP clock if there's one to use.  Returns 0 on success, >0 if there's no PTP clock, <0 on error.  Either 
+   way we don't try again once it has failed, and use the RTC instead. */
+static int open_ptp() {
+    if (PTP_METHOD_NONE != global_ptp_method) {
+        return 0;
+    }
+
+    if (global_is_ptp_unavailable || (strcmp(global_ptp_device_name, PTP_DEVICE_NONE) == 0)) {
+        return 1;
+    }
+
+    global_is_ptp_unavailable = true;
+    char device_name[PATH_MAX];
+    if (strcmp(global_ptp_device_name, PTP_DEVICE_AUTO) == 0) {
+        if (global_backend->find_ptp(device_name, sizeof(device_name)) != 0) {
+            LOG_WRITE_VERBOSE_NARG("No hypervisor PTP clock found, will use the RTC");
+            return 1;
+        }
+    } else {
+        snprintf(device_name, sizeof(device_name), "%s", global_ptp_device_name);
+    }
+
+    count_syscall();
+    if (global_backend->open_ptp(device_name) != 0) {
+        LOG_WRITE_ERROR("Unable to open PTP clock %s, will use the RTC", device_name);
+        return -1;
+    }
+
+    ptp_method_t method = probe_ptp_method();
+    if (PTP_METHOD_NONE == method) {
+        LOG_WRITE_ERROR("PTP clock %s doesn't support any PTP_SYS_OFFSET ioctl, will use the RTC", device_name);
+        global_backend->close_ptp();
+        return -1;
+    }
+
+    global_ptp_method = method;
+    global_is_ptp_unavailable = false;
+    LOG_WRITE_INFO("Using PTP clock %s via ioctl(%s)", device_name, ptp_method_to_string(method));
+    return 0;
+}
+
+static int64_t ptp_clock_time_to_nsec(const struct ptp_clock_time *t) {
+    return sec_to_nsec(t->sec) + t->nsec;
+}
+
+/* Keeps the cross-timestamp taken in the narrowest window, like get_burst_sample(). */
+static void ptp_keep_narrowest(time_sample_t *sample, bool is_first, const struct ptp_clock_time *before, 
+        const struct ptp_clock_time *phc, const struct ptp_clock_time *after) {
+    int64_t before_nsec = ptp_clock_time_to_nsec(before);
+    int64_t half_width_nsec = (ptp_clock_time_to_nsec(after) - before_nsec + 1) / 2;
+    if (is_first || (half_width_nsec < sample->error_nsec)) {
+        sample->hw_nsec = ptp_clock_time_to_nsec(phc);
+        sample->sys_nsec = before_nsec + half_width_nsec;
+        sample->error_nsec = half_width_nsec;
+    }
+}
+
+/* Takes PTP_SAMPLES cross-timestamps of the PTP clock and the system clock.  The kernel takes them all in one ioctl so 
+   there's no waiting.  Returns 0 on success, <0 on error. */
+static int get_ptp_sample(time_sample_t *sample) {
+    LOG_WRITE_VERBOSE_NARG("get_ptp_sample");
+
+    assert(sample);
+
+    int rc = -1;
+    int i;
+    switch (global_ptp_method) {
+        case PTP_METHOD_NONE:
+            return -1;
+
+        case PTP_METHOD_PRECISE: {
+            struct ptp_sys_offset_precise precise;
+            memset(&precise, 0, sizeof(precise));
+            count_syscall();
+            rc = global_backend->ptp_ioctl(PTP_SYS_OFFSET_PRECISE, &precise);
+            if (0 == rc) {
+                sample->hw_nsec = ptp_clock_time_to_nsec(&precise.device);
+                sample->sys_nsec = ptp_clock_time_to_nsec(&precise.sys_realtime);
+                sample->error_nsec = PTP_PRECISE_ERROR_NSEC;
+            }
+
+            break;
+        }
+
+        case PTP_METHOD_EXTENDED: {
+            struct ptp_sys_offset_extended extended;
+            memset(&extended, 0, sizeof(extended));
+            extended.n_samples = PTP_SAMPLES;
+            count_syscall();
+            rc = global_backend->ptp_ioctl(PTP_SYS_OFFSET_EXTENDED, &extended);
+            for (i = 0; (0 == rc) && (i < PTP_SAMPLES); i++) {
+                ptp_keep_narrowest(sample, 0 == i, &extended.ts[i][0], &extended.ts[i][1], &extended.ts[i][2]);
+            }
+
+            break;
+        }
+
+        case PTP_METHOD_BASIC: {
+            struct ptp_sys_offset basic;
+            memset(&basic, 0, sizeof(basic));
+            basic.n_samples = PTP_SAMPLES;
+            count_syscall();
+            rc = global_backend->ptp_ioctl(PTP_SYS_OFFSET, &basic);
+            for (i = 0; (0 == rc) && (i < PTP_SAMPLES); i++) {
+                ptp_keep_narrowest(sample, 0 == i, &basic.ts[2 * i], &basic.ts[(2 * i) + 1], &basic.ts[(2 * i) + 2]);
+            }
+
+            break;
+        }
+    }
+
+    if (rc != 0) {
+        LOG_WRITE_ERROR("Unable to read PTP clock via ioctl(%s)", ptp_method_to_string(global_ptp_method));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void rtc_phase_reset() {
+    global_rtc_phase.edge_count = 0;
+}
+
+/* Teach the phase tracker that the RTC ticked over to rtc_nsec at (or, because of interrupt latency, slightly before) 
+   edge_mono_nsec. */
+static void rtc_phase_observe_edge(int64_t edge_mono_nsec, int64_t rtc_nsec) {
+    rtc_phase_t *phase = &global_rtc_phase;
+
+    if (phase->edge_count > 0) {
+        int64_t predicted_mono_nsec = phase->anchor_mono_nsec + (rtc_nsec - phase->anchor_rtc_nsec);
+        int64_t residual_nsec = edge_mono_nsec - predicted_mono_nsec;
+        if (llabs(residual_nsec) <= RTC_PHASE_MAX_RESIDUAL_NSEC) {
+            /* Interrupt latency can only make an edge look late, so believe early edges straight away and only creep 
+               towards late ones.  This is a decaying minimum filter which also follows RTC vs system oscillator drift. */
+            int64_t correction_nsec = (residual_nsec < 0) ? residual_nsec : (residual_nsec >> RTC_PHASE_LATE_EDGE_SHIFT);
+            phase->anchor_mono_nsec = predicted_mono_nsec + correction_nsec;
+            phase->jitter_nsec += (llabs(residual_nsec) - phase->jitter_nsec) >> RTC_PHASE_LATE_EDGE_SHIFT;
+            phase->anchor_rtc_nsec = rtc_nsec;
+            if (phase->edge_count < UINT_MAX) {
+                phase->edge_count++;
+            }
+
+            LOG_WRITE_VERBOSE("rtc_phase_observe_edge: residual=%" NSEC_FMT " nsec correction=%" NSEC_FMT 
+                    " nsec edge_count=%u", residual_nsec, correction_nsec, phase->edge_count);
+            return;
+        }
+
+        LOG_WRITE_VERBOSE("rtc_phase_observe_edge: residual=%" NSEC_FMT " nsec is too big, re-learning RTC phase", 
+                residual_nsec);
+    }
+
+    phase->anchor_mono_nsec = edge_mono_nsec;
+    phase->anchor_rtc_nsec = rtc_nsec;
+    phase->edge_count = 1;
+    phase->jitter_nsec = 0;
+}
+
+/* Works out when the next edge after mono_nsec should be.  Returns 0 on success, >0 if we don't know. */
+static int rtc_phase_next_edge(int64_t mono_nsec, int64_t *next_edge_mono_nsec) {
+    assert(next_edge_mono_nsec);
+
+    const rtc_phase_t *phase = &global_rtc_phase;
+    int64_t age_nsec = mono_nsec - phase->anchor_mono_nsec;
+    if ((0 == phase->edge_count) || (age_nsec < 0) || (age_nsec > sec_to_nsec(RTC_PHASE_TIMEOUT_MAX_AGE_SEC))) {
+        return 1;
+    }
+
+    *next_edge_mono_nsec = phase->anchor_mono_nsec + sec_to_nsec(nsec_to_sec(age_nsec) + 1);
+    return 0;
+}
+
+/* How long after an edge we should wait for its tick interrupt before giving up. */
+static int64_t rtc_tick_margin_nsec() {
+    int64_t margin_nsec = global_rtc_phase.jitter_nsec * RTC_TICK_JITTER_MARGIN_MULTIPLE;
+    if (margin_nsec < msec_to_nsec(global_config.rtc_tick_min_margin_msec)) {
+        margin_nsec = msec_to_nsec(global_config.rtc_tick_min_margin_msec);
+    }
+
+    return margin_nsec;
+}
+
+/* Is the phase tracker good enough to predict the RTC at mono_nsec without waiting for an edge? */
+static bool rtc_phase_is_locked(int64_t mono_nsec) {
+    const rtc_phase_t *phase = &global_rtc_phase;
+    if (phase->edge_count < RTC_PHASE_MIN_EDGES) {
+        return false;
+    }
+
+    int64_t age_nsec = mono_nsec - phase->anchor_mono_nsec;
+    return (age_nsec >= 0) && (age_nsec <= sec_to_nsec(RTC_PHASE_MAX_AGE_SEC));
+}
+
+/* Works out the sub-second RTC time at mono_nsec, given that RTC_RD_TIME returned rtc_nsec just before then.  Returns 
+   0 on success, >0 if the prediction can't be trusted and we should wait for an edge instead. */
+static int rtc_phase_predict(int64_t mono_nsec, int64_t rtc_nsec, int64_t *predicted_rtc_nsec) {
+    assert(predicted_rtc_nsec);
+
+    if (!rtc_phase_is_locked(mono_nsec)) {
+        return 1;
+    }
+
+    const rtc_phase_t *phase = &global_rtc_phase;
+    int64_t elapsed_nsec = mono_nsec - phase->anchor_mono_nsec;
+    int64_t elapsed_whole_sec = nsec_to_sec(elapsed_nsec);
+    int64_t fraction_nsec = elapsed_nsec - sec_to_nsec(elapsed_whole_sec);
+    if ((fraction_nsec < RTC_PHASE_GUARD_NSEC) || (fraction_nsec > (sec_to_nsec(1) - RTC_PHASE_GUARD_NSEC))) {
+        LOG_WRITE_VERBOSE("rtc_phase_predict: fraction=%" NSEC_FMT " nsec is too close to an edge", fraction_nsec);
+        return 1;
+    }
+
+    int64_t expected_rtc_nsec = phase->anchor_rtc_nsec + sec_to_nsec(elapsed_whole_sec);
+    if (expected_rtc_nsec != rtc_nsec) {
+        LOG_WRITE_VERBOSE("rtc_phase_predict: expected_rtc=%" NSEC_FMT " but rtc=%" NSEC_FMT 
+                ", re-learning RTC phase", expected_rtc_nsec, rtc_nsec);
+        rtc_phase_reset();
+        return 1;
+    }
+
+    *predicted_rtc_nsec = rtc_nsec + fraction_nsec;
+    return 0;
+}
+
+/* Called inside measurement windows, so nothing is logged unless clock_gettime() fails, when the sample is lost 
+   anyway and the caller needs to know why. */
+static int get_system_now(int64_t *epoch_nsec) {
+    if (global_backend->get_system_now(epoch_nsec) != 0) {
+        LOG_WRITE_ERROR_NARG("clock_gettime(CLOCK_REALTIME) failed");
+        return -1;
+    }
+
+    PROBE1(sys_read, *epoch_nsec);
+    return 0;
+}
+/* Returns zero on success, positive on timeout, negative on other error. */
+static int select_on_rtc(int64_t timeout_nsec) {
+    count_syscall();
+    int rc = global_backend->wait_for_rtc_interrupt(timeout_nsec);
+    
+    if (should_exit()) {
+        LOG_WRITE_INFO_NARG("select() interrupted by signal, will exit ASAP");
+        return -1;
+    }
+
+    if (0 == rc) {
+        /* Really this should be an ERROR log but this happens once every few minutes on my WSL2 system.  Far from 
+           ideal but we can fall back to polling the RTC. */
+        LOG_WRITE_VERBOSE("Waiting for clock tick interrupt timed out.  timeout=%" NSEC_FMT " nsec", timeout_nsec);
+        return 1;
+    } 
+    
+    if (rc < 0) {
+        LOG_WRITE_ERROR("Waiting for clock tick interrupt failed.  timeout=%" NSEC_FMT " nsec", timeout_nsec);
+        return -1;
+    } 
+
+    return 0;
+}
+
+static int read_interrupt_info_from_rtc() {
+    LOG_WRITE_VERBOSE_NARG("About to read() on RTC");
+    unsigned long interrupt_info;
+    count_syscall();
+    if (global_backend->read_rtc_interrupt(&interrupt_info) != 0) {
+        LOG_WRITE_ERROR_NARG("read() on RTC failed");
+        return -1;
+    } 
+
+    /* Least significant byte contains the interrupt that fired. */
+    uint8_t interrupt = (uint8_t)interrupt_info;
+    LOG_WRITE_VERBOSE("read() on RTC returned interrupt bitmask=0x%02x", (unsigned int)interrupt);
+    return 0;
+}
+
+/* A tick interrupt can be left over from the last time they were on, or from before somebody else turned them on for 
+   us.  If we didn't throw it away then the next select() would return straight away, nowhere near an edge. */
+static int discard_pending_rtc_tick() {
+    count_syscall();
+    int rc = global_backend->wait_for_rtc_interrupt(0);
+    if (rc < 0) {
+        LOG_WRITE_ERROR_NARG("Polling for a stale clock tick interrupt failed");
+        return -1;
+    }
+
+    if (0 == rc) {
+        return 0;
+    }
+
+    LOG_WRITE_VERBOSE_NARG("Discarding stale clock tick interrupt");
+    return read_interrupt_info_from_rtc();
+}
+    
+
+/* How long to wait for the next tick interrupt, given that we start waiting at mono_nsec. */
+static int64_t get_rtc_tick_timeout_nsec(int64_t mono_nsec) {
+    int64_t next_edge_mono_nsec;
+    if (rtc_phase_next_edge(mono_nsec, &next_edge_mono_nsec) != 0) {
+        return sec_to_nsec(1) + rtc_tick_margin_nsec();
+    }
+
+    /* An edge due any moment might really have just happened, with its interrupt thrown away as stale, so give the 
+       one after it time to arrive too. */
+    int64_t timeout_nsec = next_edge_mono_nsec - mono_nsec;
+    if (timeout_nsec < rtc_tick_margin_nsec()) {
+        timeout_nsec += sec_to_nsec(1);
+    }
+
+    return timeout_nsec + rtc_tick_margin_nsec();
+}
+
+static void sleep_nsec(int64_t nsec) {
+    global_backend->sleep_nsec(nsec);
+}
+
+/* Used when the tick interrupt goes missing.  Reads the RTC over and over until it ticks over, sleeping until just 
+   before the next edge first if we know when that will be.  Returns 0 on success, >0 if we gave up, <0 on other error. 
+   On success edge is the time just after we saw the new second. */
+static int poll_for_rtc_tick(rtc_edge_t *edge) {
+    LOG_WRITE_VERBOSE_NARG("poll_for_rtc_tick");
+
+    assert(edge);
+
+    int64_t start_mono_nsec = -1;
+    if (get_monotonic_now(&start_mono_nsec) != 0) {
+        return -1;
+    }
+
+    if ((global_rtc_stats.poll_fallbacks > 0) && ((start_mono_nsec - global_rtc_stats.last_poll_fallback_mono_nsec) < 
+            sec_to_nsec(RTC_POLL_FALLBACK_MIN_INTERVAL_SEC))) {
+        LOG_WRITE_VERBOSE_NARG("poll_for_rtc_tick: polled too recently, giving up");
+        return 1;
+    }
+
+    global_rtc_stats.poll_fallbacks++;
+    global_rtc_stats.last_poll_fallback_mono_nsec = start_mono_nsec;
+
+    int64_t start_rtc_nsec = -1;
+    if (read_rtc_as_epoch_nsec(&start_rtc_nsec) != 0) {
+        return -1;
+    }
+
+    /* Oversleeping the edge is fine because we then just catch the one after. */
+    int64_t next_edge_mono_nsec;
+    int64_t mono_nsec = start_mono_nsec;
+    if (rtc_phase_next_edge(start_mono_nsec, &next_edge_mono_nsec) == 0) {
+        int64_t sleep_until_mono_nsec = next_edge_mono_nsec - msec_to_nsec(RTC_POLL_LEAD_MSEC);
+        if (sleep_until_mono_nsec > start_mono_nsec) {
+            sleep_nsec(sleep_until_mono_nsec - start_mono_nsec);
+            if (get_monotonic_now(&mono_nsec) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    const int64_t deadline_mono_nsec = mono_nsec + msec_to_nsec(RTC_POLL_MAX_MSEC);
+    int64_t last_rtc_nsec = start_rtc_nsec;
+    int64_t last_mono_nsec = start_mono_nsec;
+    while (!should_exit() && (mono_nsec < deadline_mono_nsec)) {
+        struct rtc_time rtct;
+        if (read_rtc(&rtct) != 0) {
+            return -1;
+        }
+
+        int64_t sys_nsec = -1;
+        if ((get_monotonic_now(&mono_nsec) != 0) || (get_system_now(&sys_nsec) != 0)) {
+            return -1;
+        }
+
+        struct tm tm;
+        int64_t rtc_nsec = -1;
+        rtc_time_to_tm(&rtct, &tm);
+        if (tm_to_epoch_nsec(&tm, &rtc_nsec) != 0) {
+            return -1;
+        }
+
+        /* We only know where the edge is if it happened between two reads close together, which isn't the case 
+           straight after the sleep above or if we were preempted. */
+        bool is_bracketed = (mono_nsec - last_mono_nsec) <= (4 * RTC_POLL_STEP_NSEC);
+        if ((rtc_nsec != last_rtc_nsec) && is_bracketed) {
+            LOG_WRITE_VERBOSE("poll_for_rtc_tick: RTC ticked over after %" NSEC_FMT " nsec", 
+                    mono_nsec - start_mono_nsec);
+            edge->mono_nsec = mono_nsec;
+            edge->sys_nsec = sys_nsec;
+            edge->error_nsec = mono_nsec - last_mono_nsec;
+            return 0;
+        }
+
+        last_rtc_nsec = rtc_nsec;
+        last_mono_nsec = mono_nsec;
+        sleep_nsec(RTC_POLL_STEP_NSEC);
+    }
+
+    global_rtc_stats.poll_fallback_failures++;
+    LOG_WRITE_VERBOSE_NARG("poll_for_rtc_tick: RTC didn't tick over");
+    return 1;
+}
+
+/* Waits for the next tick interrupt, which must already be turned on.  Returns 0 on success, >0 on timeout, <0 on other 
+   error. */
+static int wait_for_rtc_tick_interrupt(rtc_edge_t *edge) {
+    if (discard_pending_rtc_tick() != 0) {
+        return -1;
+    }
+
+    int64_t mono_nsec = -1;
+    if (get_monotonic_now(&mono_nsec) != 0) {
+        return -1;
+    }
+
+    LOG_WRITE_VERBOSE_NARG("selecting on RTC");
+    global_rtc_stats.tick_waits++;
+    int64_t timeout_nsec = get_rtc_tick_timeout_nsec(mono_nsec);
+    PROBE2(tick_wait_start, mono_nsec, timeout_nsec);
+    int rc = select_on_rtc(timeout_nsec);
+    if (rc > 0) {
+        global_rtc_stats.tick_timeouts++;
+        PROBE3(tick_wait_end, rc, -1, -1);
+        return rc;
+    }
+
+    if (rc < 0) {
+        PROBE3(tick_wait_end, rc, -1, -1);
+        return -1;
+    }
+
+    /* Grab the times before anything else so that we're as close to the edge as possible. */
+    if ((get_monotonic_now(&edge->mono_nsec) != 0) || (get_system_now(&edge->sys_nsec) != 0)) {
+        return -1;
+    }
+
+    PROBE3(tick_wait_end, rc, edge->mono_nsec, edge->sys_nsec);
+
+    histogram_observe(&global_rtc_stats.tick_wait_seconds, nsec_to_seconds(edge->mono_nsec - mono_nsec));
+
+    /* We can't see interrupt latency directly, so assume it's similar to the lateness we've seen before. */
+    edge->error_nsec = global_rtc_phase.jitter_nsec;
+
+    /* We need to read() from the RTC fd after select()ing to reset it so the select() will wait next time. */
+    return read_interrupt_info_from_rtc();
+}
+
+/* The hardware clock has a granularity of 1 second so we need to wait for the second to tick over before trying to do 
+   anything, so we can be as accurate as possible.  On success edge is the time at which we saw the tick.  Returns 0 on 
+   success, >0 on timeout, <0 on other error. */
+static int wait_for_rtc_tick(rtc_edge_t *edge) {
+    LOG_WRITE_VERBOSE_NARG("wait_for_rtc_tick");
+
+    assert(edge);
+
+    LOG_WRITE_VERBOSE_NARG("opening RTC");
+    if (open_rtc() != 0) {
+        return -1;
+    }
+
+    /* Tick interrupts are only on while we wait for one, so that an idle daemon doesn't cost the kernel (and the 
+       hypervisor) an interrupt every second.  If we can't have them at all then polling will do. */
+    int rc = 1;
+    if (enable_rtc_tick_interrupt() == 0) {
+        rc = wait_for_rtc_tick_interrupt(edge);
+        disable_rtc_tick_interrupt();
+    }
+
+    if (rc > 0) {
+        rc = poll_for_rtc_tick(edge);
+    }
+
+    LOG_WRITE_VERBOSE_NARG("wait_for_rtc_tick end");
+    return rc;
+}
+
+/* Takes one sample by reading the RTC straight away, bracketed by system clock reads, and using the phase tracker to 
+   fill in the sub-second part.  Returns 0 on success, >0 if the phase tracker couldn't help, <0 on other error. */
+static int get_bracketed_sample(time_sample_t *sample) {
+    assert(sample);
+
+    int64_t sys_before_nsec = -1;
+    int64_t mono_before_nsec = -1;
+    if ((get_system_now(&sys_before_nsec) != 0) || (get_monotonic_now(&mono_before_nsec) != 0)) {
+        return -1;
+    }
+
+    struct rtc_time rtct;
+    if (read_rtc(&rtct) != 0) {
+        return -1;
+    }
+
+    int64_t mono_after_nsec = -1;
+    int64_t sys_after_nsec = -1;
+    if ((get_monotonic_now(&mono_after_nsec) != 0) || (get_system_now(&sys_after_nsec) != 0)) {
+        return -1;
+    }
+
+    struct tm tm;
+    int64_t rtc_nsec = -1;
+    rtc_time_to_tm(&rtct, &tm);
+    if (tm_to_epoch_nsec(&tm, &rtc_nsec) != 0) {
+        return -1;
+    }
+
+    /* We don't know exactly when in the window the RTC was read, so assume the middle. */
+    int64_t mono_nsec = mono_before_nsec + ((mono_after_nsec - mono_before_nsec) / 2);
+    int rc = rtc_phase_predict(mono_nsec, rtc_nsec, &sample->hw_nsec);
+    if (rc != 0) {
+        return rc;
+    }
+
+    sample->sys_nsec = sys_before_nsec + ((sys_after_nsec - sys_before_nsec) / 2);
+    sample->error_nsec = ((sys_after_nsec - sys_before_nsec) / 2) + global_rtc_phase.jitter_nsec;
+    return 0;
+}
+
+/* Takes a burst of bracketed samples and keeps the one taken in the narrowest window, because that's the one least 
+   disturbed by ioctl latency and preemption, like NTP's clock filter.  Returns 0 on success, >0 if the phase tracker 
+   couldn't help, <0 on other error. */
+static int get_burst_sample(time_sample_t *sample) {
+    LOG_WRITE_VERBOSE_NARG("get_burst_sample");
+
+    assert(sample);
+
+    int good_count = 0;
+    int i;
+    for (i = 0; i < RTC_BURST_SAMPLES; i++) {
+        time_sample_t candidate;
+        int rc = get_bracketed_sample(&candidate);
+        if (rc < 0) {
+            return -1;
+        }
+
+        if (0 == global_rtc_phase.edge_count) {
+            /* The RTC disagreed with the phase tracker so none of the samples can be trusted. */
+            return 1;
+        }
+
+        if ((0 == rc) && ((0 == good_count) || (candidate.error_nsec < sample->error_nsec))) {
+            *sample = candidate;
+        }
+
+        good_count += (0 == rc) ? 1 : 0;
+    }
+
+    LOG_WRITE_VERBOSE("get_burst_sample: good_count=%d/%d best error=%" NSEC_FMT " nsec", good_count, 
+            RTC_BURST_SAMPLES, (good_count > 0) ? sample->error_nsec : (int64_t)-1);
+    return (good_count > 0) ? 0 : 1;
+}
+
+/* Waits for the RTC to tick and samples the system clock as close to the tick as we can.  Returns 0 on success, >0 if we 
+   timed out waiting for the RTC but still read the times, <0 on other error. */
+static int get_edge_sample(time_sample_t *sample) {
+    LOG_WRITE_VERBOSE_NARG("get_edge_sample");
+
+    assert(sample);
+
+    rtc_edge_t edge = { -1, -1, 0 };
+    int wait_rc = wait_for_rtc_tick(&edge);
+    if (wait_rc < 0) {
+        return -1;
+    }
+
+    if (wait_rc > 0) {
+        /* This should really be an INFO but it happens a lot on my WSL2 system and we don't react to small deltas. 
+           We need to read the clock anyway because a big change might be required- this happens more often after
+           waking from some kind of suspend. */
+        LOG_WRITE_VERBOSE_NARG("Waiting for RTC timed out but we will read the clock now anyway");
+    }
+
+    if (read_rtc_as_epoch_nsec(&sample->hw_nsec) != 0) {
+        return -1;
+    }
+
+    if (0 == wait_rc) {
+        sample->sys_nsec = edge.sys_nsec;
+        sample->error_nsec = edge.error_nsec;
+        rtc_phase_observe_edge(edge.mono_nsec, sample->hw_nsec);
+    } else {
+        if (get_system_now(&sample->sys_nsec) != 0) {
+            return -1;
+        }
+
+        /* The RTC could be anywhere in its second. */
+        sample->error_nsec = sec_to_nsec(1);
+    }
+
+    return wait_rc;
+}
+
+/* Returns 0 on success, >0 if we timed out waiting for the RTC but still read the times, <0 on other error.  When the 
+   result is 0 the hardware time has sub-second resolution, otherwise it is truncated to the whole second. */
+static int get_times(time_sample_t *sample) {
+    LOG_WRITE_VERBOSE_NARG("get_times");
+
+    assert(sample);
+
+    /* This function is extremely time-sensitive.  We need to get the system time ASAP after getting the hardware time.
+       Don't be tempted to get the system time first because we need to wait for the hardware clock to tick. */
+
+    /* A PTP clock gives us sub-second time straight away, so the RTC is just a fallback. */
+    if ((open_ptp() == 0) && (get_ptp_sample(sample) == 0)) {
+        PROBE4(sample, 0, sample->hw_nsec, sample->sys_nsec, sample->error_nsec);
+        LOG_WRITE_VERBOSE("get_times: ptp hw=%" NSEC_FMT " sys=%" NSEC_FMT " error=%" NSEC_FMT, 
+                sample->hw_nsec, sample->sys_nsec, sample->error_nsec);
+        return 0;
+    }
+
+    int rc = 1;
+    int64_t mono_nsec = -1;
+    if (get_monotonic_now(&mono_nsec) != 0) {
+        return -1;
+    }
+
+    if (rtc_phase_is_locked(mono_nsec)) {
+        rc = get_burst_sample(sample);
+        if (rc < 0) {
+            return -1;
+        }
+    }
+
+    if (rc > 0) {
+        rc = get_edge_sample(sample);
+        if (rc < 0) {
+            return -1;
+        }
+    }
+
+    PROBE4(sample, rc, sample->hw_nsec, sample->sys_nsec, sample->error_nsec);
+    LOG_WRITE_VERBOSE("get_times: hw=%" NSEC_FMT " sys=%" NSEC_FMT " error=%" NSEC_FMT " rc=%d", 
+            sample->hw_nsec, sample->sys_nsec, sample->error_nsec, rc);
+    return rc;
+}
+
+static int64_t calculate_delta(int64_t hw_time, int64_t sys_time) {
+    return hw_time - sys_time;
+}
+
+/* Touches the stack we're going to need so that those pages are already there, and with mlockall() stay there. */
+static void __attribute__((noinline)) prefault_stack() {
+    volatile char buf[STACK_PREFAULT_BYTES];
+    size_t i;
+    for (i = 0; i < sizeof(buf); i += 1024) {
+        buf[i] = 0;
+    }
+}
+
+/* Gets the process ready for low-jitter measurements: locks its pages into RAM so that the measurement window can't 
+   page fault and pins it to one CPU.  Failures are logged but not fatal because we can still keep time, just not as 
+   well. */
+static void setup_low_jitter() {
+    if (global_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(global_cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            LOG_WRITE_ERROR("Unable to pin to CPU %d", global_cpu);
+        }
+    }
+
+    if (0 == global_rt_priority) {
+        return;
+    }
+
+    global_normal_sched_policy = sched_getscheduler(0);
+    if ((global_normal_sched_policy < 0) || (sched_getparam(0, &global_normal_sched_param) != 0)) {
+        LOG_WRITE_ERROR_NARG("Unable to get the scheduling policy, real-time measurements disabled");
+        global_rt_priority = 0;
+        return;
+    }
+
+    prefault_stack();
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        LOG_WRITE_ERROR_NARG("Unable to lock memory with mlockall()");
+    }
+
+    LOG_WRITE_INFO("Measuring at SCHED_FIFO priority %d", global_rt_priority);
+}
+
+/* Raises us to SCHED_FIFO so that nothing else can run between reading one clock and the next.  No logging unless it 
+   fails, because the window is time-sensitive. */
+static void begin_measurement_window() {
+    if (0 == global_rt_priority) {
+        return;
+    }
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = global_rt_priority;
+    count_syscall();
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) != 0) {
+        /* Probably no CAP_SYS_NICE.  Don't keep trying and failing every measurement. */
+        LOG_WRITE_ERROR("Unable to switch to SCHED_FIFO priority %d, real-time measurements disabled", 
+                global_rt_priority);
+        global_rt_priority = 0;
+    }
+}
+
+/* Drops back to normal scheduling for logging and decisions. */
+static void end_measurement_window() {
+    if (0 == global_rt_priority) {
+        return;
+    }
+
+    count_syscall();
+    if (sched_setscheduler(0, global_normal_sched_policy, &global_normal_sched_param) != 0) {
+        LOG_WRITE_ERROR_NARG("Unable to switch back from SCHED_FIFO");
+    }
+}
+
+/* Returns 0 on success, >0 if we timed out waiting for the RTC but still read the times, <0 on other error.  
+   sample.error_nsec is how wrong the delta could be. */
+static int get_delta(time_sample_t *sample, int64_t *delta) {
+    assert(sample);
+    assert(delta);
+
+    begin_measurement_window();
+    int rc = get_times(sample);
+    end_measurement_window();
+    if (rc < 0) {
+        return -1;
+    }
+
+    *delta = calculate_delta(sample->hw_nsec, sample->sys_nsec);
+    return rc;
+}
+
+
+/* How much of the tick slew is still to come. */
+static int64_t slew_remaining_nsec() {
+    const slew_t *slew = &global_slew;
+    int64_t mono_nsec = -1;
+    if (!slew->is_active || (get_monotonic_now(&mono_nsec) != 0) || (mono_nsec >= slew->end_mono_nsec)) {
+        return 0;
+    }
+
+    if (mono_nsec <= slew->start_mono_nsec) {
+        return slew->delta_nsec;
+    }
+
+    /* In double because the product overflows int64_t for long slews. */
+    return (int64_t)(((double)slew->delta_nsec * (slew->end_mono_nsec - mono_nsec)) / 
+            (slew->end_mono_nsec - slew->start_mono_nsec));
+}
+
+/* Includes any tick slew in progress, because it's just a faster adjtime() as far as callers are concerned. */
+static int get_current_time_adjustment_delta(int64_t *current_delta) {
+    LOG_WRITE_VERBOSE_NARG("get_current_time_adjustment_delta");
+
+    assert(current_delta);
+    /* There's an old bug where adjtime(NULL &old) would not set old.  We're super-unlikely to encounter it because 
+       it's back in Linux 2.6 so old but just in case we'll set old to a big value. */
+    struct timeval old = { .tv_sec = LONG_MAX, .tv_usec = 0 };
+    count_syscall();
+    if (global_backend->adjtime(NULL, &old) != 0) {
+        LOG_WRITE_ERROR_NARG("Unable to get current adjtime delta");
+        return -1;
+    }
+
+    *current_delta = tv_to_epoch_nsec(&old) + slew_remaining_nsec();
+    LOG_WRITE_VERBOSE("current_adjtime_delta=%" NSEC_FMT, *current_delta);
+    return 0;
+}
+
+static int get_kernel_frequency(long *freq) {
+    assert(freq);
+
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    count_syscall();
+    if (global_backend->clock_adjtime(CLOCK_REALTIME, &tx) < 0) {
+        LOG_WRITE_ERROR_NARG("Unable to get the kernel clock frequency via adjtimex()");
+        return -1;
+    }
+
+    *freq = tx.freq;
+    return 0;
+}
+
+static int set_kernel_frequency(long freq) {
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_FREQUENCY;
+    tx.freq = freq;
+    PROBE1(set_frequency, freq);
+    count_syscall();
+    if (global_backend->clock_adjtime(CLOCK_REALTIME, &tx) < 0) {
+        LOG_WRITE_ERROR("Unable to set the kernel clock frequency via adjtimex().  freq=%ld", freq);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns true if something else, usually an NTP daemon, has synchronised the system clock and is keeping it that 
+   way.  If it claims to have but hasn't updated its error estimate for a long time then it has probably died and we 
+   take over, but the status is left alone: an NTP daemon that's merely polling slowly would fight us over it, and the 
+   kernel marks the clock unsynchronised by itself once the error reaches NTP_PHASE_LIMIT_SEC. */
+static bool is_ntp_active() {
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    count_syscall();
+    if (global_backend->clock_adjtime(CLOCK_REALTIME, &tx) < 0) {
+        LOG_WRITE_ERROR_NARG("Unable to get the kernel clock status via adjtimex()");
+        return false;
+    }
+
+    if (tx.status & STA_UNSYNC) {
+        return false;
+    }
+
+    if (tx.maxerror < (msec_to_nsec(NTP_MAX_ERROR_MSEC) / 1000)) {
+        LOG_WRITE_VERBOSE("Clock is synchronised by NTP.  status=0x%x maxerror=%ld usec esterror=%ld usec", 
+                tx.status, tx.maxerror, tx.esterror);
+        return true;
+    }
+
+    LOG_WRITE_VERBOSE("NTP hasn't updated the clock for a long time.  status=0x%x maxerror=%ld usec", tx.status, 
+            tx.maxerror);
+    return false;
+}
+
+/* Starts a fresh estimate from a single sample of the eventual delta with the given variance.  Until there's a second 
+   sample the skew could be anything the kernel could correct. */
+static void estimator_start(offset_estimator_t *est, int64_t mono_nsec, double offset_nsec, double variance, 
+        bool is_precise) {
+    memset(est, 0, sizeof(*est));
+    est->samples = 1;
+    est->is_precise = is_precise;
+    est->mono_nsec = mono_nsec;
+    est->offset_nsec = offset_nsec;
+    est->offset_variance = variance;
+    est->skew_variance = ((double)FREQ_MAX_PPM / (1000 * 1000)) * ((double)FREQ_MAX_PPM / (1000 * 1000));
+}
+
+/* Moves the estimate on to mono_nsec, becoming less sure of it as the clocks wander. */
+static void estimator_predict(offset_estimator_t *est, int64_t mono_nsec) {
+    double dt = (double)(mono_nsec - est->mono_nsec);
+    if (dt <= 0) {
+        return;
+    }
+
+    /* Per nsec. */
+    const double offset_wander = ((double)ESTIMATOR_OFFSET_WANDER_NSEC * ESTIMATOR_OFFSET_WANDER_NSEC) / NSEC_PER_SEC;
+    const double skew_wander = (((double)ESTIMATOR_SKEW_WANDER_PPB / NSEC_PER_SEC) * 
+            ((double)ESTIMATOR_SKEW_WANDER_PPB / NSEC_PER_SEC)) / NSEC_PER_SEC;
+
+    est->offset_nsec += est->skew * dt;
+    est->offset_variance += (dt * ((2 * est->covariance) + (dt * est->skew_variance))) + (offset_wander * dt) + 
+            ((skew_wander * dt * dt * dt) / 3);
+    est->covariance += (dt * est->skew_variance) + ((skew_wander * dt * dt) / 2);
+    est->skew_variance += skew_wander * dt;
+    est->mono_nsec = mono_nsec;
+}
+
+/* Feeds in a measurement of the eventual delta, which could be wrong by error_nsec.  Returns false if it was an 
+   outlier and ignored. */
+static bool estimator_observe(offset_estimator_t *est, int64_t mono_nsec, int64_t eventual_delta, int64_t error_nsec, 
+        bool is_precise) {
+    double variance = (double)error_nsec * error_nsec;
+    if ((0 == est->samples) || (is_precise && !est->is_precise)) {
+        /* A delta truncated to the second tells us next to nothing once we have a precise one. */
+        estimator_start(est, mono_nsec, eventual_delta, variance, is_precise);
+        return true;
+    }
+
+    estimator_predict(est, mono_nsec);
+    double innovation = eventual_delta - est->offset_nsec;
+    double innovation_variance = est->offset_variance + variance;
+    if ((innovation * innovation) > (ESTIMATOR_OUTLIER_SIGMAS * ESTIMATOR_OUTLIER_SIGMAS * innovation_variance)) {
+        est->outliers++;
+        if (est->outliers < ESTIMATOR_MAX_OUTLIERS) {
+            LOG_WRITE_VERBOSE("Ignoring outlier.  eventual_delta=%" NSEC_FMT " expected=%.0f sigma=%.0f", 
+                    eventual_delta, est->offset_nsec, sqrt(innovation_variance));
+            return false;
+        }
+
+        LOG_WRITE_VERBOSE("%u outliers in a row, the clock must have jumped.  Starting a fresh estimate", 
+                est->outliers);
+        estimator_start(est, mono_nsec, eventual_delta, variance, is_precise);
+        return true;
+    }
+
+    double offset_gain = est->offset_variance / innovation_variance;
+    double skew_gain = est->covariance / innovation_variance;
+    est->offset_nsec += offset_gain * innovation;
+    est->skew += skew_gain * innovation;
+    est->skew_variance -= skew_gain * est->covariance;
+    est->covariance *= 1 - offset_gain;
+    est->offset_variance *= 1 - offset_gain;
+    est->outliers = 0;
+    if (est->samples < UINT_MAX) {
+        est->samples++;
+    }
+
+    return true;
+}
+
+/* Tell the estimators that we moved the system clock forward by adjustment_nsec, so it isn't mistaken for drift. */
+static void note_adjustment(int64_t adjustment_nsec) {
+    global_freq_estimator.adjusted_nsec += adjustment_nsec;
+    global_offset_estimator.offset_nsec -= adjustment_nsec;
+}
+
+static int get_kernel_tick(long *tick) {
+    assert(tick);
+
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    count_syscall();
+    if (global_backend->clock_adjtime(CLOCK_REALTIME, &tx) < 0) {
+        LOG_WRITE_ERROR_NARG("Unable to get the kernel tick length via adjtimex()");
+        return -1;
+    }
+
+    *tick = tx.tick;
+    return 0;
+}
+
+static int set_kernel_tick(long tick) {
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_TICK;
+    tx.tick = tick;
+    count_syscall();
+    if (global_backend->clock_adjtime(CLOCK_REALTIME, &tx) < 0) {
+        LOG_WRITE_ERROR("Unable to set the kernel tick length via adjtimex().  tick=%ld usec", tick);
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool is_slew_engine_enabled() {
+    /* A one-off run can't wait around to put the tick back. */
+    return (global_slew_ppm > ADJTIME_SLEW_PPM) && (RUN_MODE_ONCE != global_run_mode);
+}
+
+/* Puts the tick back, abandoning the rest of the slew.  Returns how much of the slew was still to come. */
+static int64_t stop_slew() {
+    slew_t *slew = &global_slew;
+    if (!slew->is_active) {
+        return 0;
+    }
+
+    int64_t remaining_nsec = slew_remaining_nsec();
+    set_kernel_tick(slew->original_tick);
+    slew->is_active = false;
+    global_is_state_dirty = true;
+    note_adjustment(-remaining_nsec);
+    LOG_WRITE_VERBOSE("stop_slew: remaining=%" NSEC_FMT " nsec", remaining_nsec);
+    return remaining_nsec;
+}
+
+/* Puts the tick back once the slew has run its course. */
+static void finish_slew_if_due() {
+    slew_t *slew = &global_slew;
+    int64_t mono_nsec = -1;
+    if (!slew->is_active || (get_monotonic_now(&mono_nsec) != 0) || (mono_nsec < slew->end_mono_nsec)) {
+        return;
+    }
+
+    set_kernel_tick(slew->original_tick);
+    slew->is_active = false;
+    global_is_state_dirty = true;
+    LOG_WRITE_VERBOSE("Finished slewing %" NSEC_FMT " nsec, %" NSEC_FMT " nsec late", slew->delta_nsec, 
+            mono_nsec - slew->end_mono_nsec);
+}
+
+/* How long we can set the poll timer for without overrunning the end of the slew.  The timer's CLOCK_BOOTTIME runs at 
+   the slewed rate, so the wait is scaled by the tick or a slew that shortens it would wake us late and overshoot. */
+static int64_t get_slew_wait_nsec(int64_t max_nsec) {
+    const slew_t *slew = &global_slew;
+    int64_t mono_nsec = -1;
+    if (!slew->is_active || (get_monotonic_now(&mono_nsec) != 0)) {
+        return max_nsec;
+    }
+
+    int64_t wait_nsec = slew->end_mono_nsec - mono_nsec;
+    if (wait_nsec < 1) {
+        return 1;
+    }
+
+    /* Rounded up so that we don't wake just short of the end.  In double because the product overflows int64_t for 
+       long slews. */
+    wait_nsec = (int64_t)ceil(((double)wait_nsec * slew->tick) / slew->original_tick);
+    return (wait_nsec < max_nsec) ? wait_nsec : max_nsec;
+}
+
+/* Slews the clock by delta at global_slew_ppm by changing the kernel's tick length, taking over from any adjtime() or 
+   slew already in progress.  The clock never runs backwards because the tick can't be shortened by more than 10%.  
+   Returns 0 on success. */
+static int start_slew(int64_t delta) {
+    LOG_WRITE_VERBOSE("start_slew, delta=%" NSEC_FMT, delta);
+
+    struct timeval zero = { 0, 0 };
+    struct timeval old = { 0, 0 };
+    count_syscall();
+    if (global_backend->adjtime(&zero, &old) != 0) {
+        LOG_WRITE_ERROR_NARG("Unable to cancel adjtime() before slewing");
+        return -1;
+    }
+
+    note_adjustment(-tv_to_epoch_nsec(&old));
+    stop_slew();
+
+    slew_t *slew = &global_slew;
+    long original_tick = 0;
+    int64_t mono_nsec = -1;
+    if ((get_kernel_tick(&original_tick) != 0) || (get_monotonic_now(&mono_nsec) != 0)) {
+        return -1;
+    }
+
+    const long base_tick = get_base_tick();
+    long tick_step = (long)((global_slew_ppm * base_tick) / (1000 * 1000));
+    int64_t rate_ppm = ((int64_t)tick_step * 1000 * 1000) / base_tick;
+    long tick = original_tick + ((delta > 0) ? tick_step : -tick_step);
+    if (set_kernel_tick(tick) != 0) {
+        return -1;
+    }
+
+    slew->is_active = true;
+    slew->original_tick = original_tick;
+    slew->tick = tick;
+    slew->start_mono_nsec = mono_nsec;
+    slew->end_mono_nsec = mono_nsec + ((llabs(delta) * 1000 * 1000) / rate_ppm);
+    slew->delta_nsec = delta;
+    global_is_state_dirty = true;
+    note_adjustment(delta);
+    LOG_WRITE_INFO("Time is slewing politely.  delta=%" NSEC_FMT " nsec  rate=%" PRId64 " ppm  duration=%.1f sec", 
+            delta, rate_ppm, nsec_to_seconds(slew->end_mono_nsec - slew->start_mono_nsec));
+    return 0;
+}
+
+/* Watches how the delta drifts when we aren't adjusting the clock and programs the kernel's frequency offset to cancel 
+   the drift out.  Only precise deltas should be fed in. */
+static int discipline_frequency(int64_t delta) {
+    LOG_WRITE_VERBOSE_NARG("discipline_frequency");
+
+    freq_estimator_t *est = &global_freq_estimator;
+
+    int64_t pending_nsec = 0;
+    if (get_current_time_adjustment_delta(&pending_nsec) != 0) {
+        return -1;
+    }
+
+    int64_t mono_nsec = -1;
+    if (get_monotonic_now(&mono_nsec) != 0) {
+        return -1;
+    }
+
+    int64_t eventual_delta_nsec = delta - pending_nsec;
+    if (!est->has_reference) {
+        est->has_reference = true;
+        est->reference_mono_nsec = mono_nsec;
+        est->reference_eventual_delta_nsec = eventual_delta_nsec;
+        est->adjusted_nsec = 0;
+        return 0;
+    }
+
+    int64_t elapsed_nsec = mono_nsec - est->reference_mono_nsec;
+    if (elapsed_nsec < sec_to_nsec(FREQ_ESTIMATE_INTERVAL_SEC)) {
+        return 0;
+    }
+
+    /* A system clock that runs fast makes the delta shrink, so the drift is exactly the frequency change we need. */
+    int64_t drift_nsec = (eventual_delta_nsec + est->adjusted_nsec) - est->reference_eventual_delta_nsec;
+
+    est->reference_mono_nsec = mono_nsec;
+    est->reference_eventual_delta_nsec = eventual_delta_nsec;
+    est->adjusted_nsec = 0;
+
+    /* Much more drift than any frequency error we could correct means something else (eg a suspend or somebody else 
+       stepping the clock) moved the clock, so start again.  In double because nsec times a million can overflow. */
+    double drift_ppm = ((double)drift_nsec * 1000 * 1000) / elapsed_nsec;
+    if ((drift_ppm > (2 * FREQ_MAX_PPM)) || (drift_ppm < -(2 * FREQ_MAX_PPM))) {
+        LOG_WRITE_VERBOSE("discipline_frequency: drift=%" NSEC_FMT " nsec over %" NSEC_FMT 
+                " nsec is implausible, starting again", drift_nsec, elapsed_nsec);
+        return 0;
+    }
+
+    int64_t error = (int64_t)(drift_ppm * ADJTIMEX_FREQ_SCALE);
+
+    long freq = 0;
+    if (get_kernel_frequency(&freq) != 0) {
+        return -1;
+    }
+
+    const int64_t max_freq = (int64_t)FREQ_MAX_PPM * ADJTIMEX_FREQ_SCALE;
+    int64_t new_freq = freq + error;
+    if (new_freq > max_freq) {
+        new_freq = max_freq;
+    } else if (new_freq < -max_freq) {
+        new_freq = -max_freq;
+    }
+
+    if (set_kernel_frequency((long)new_freq) != 0) {
+        return -1;
+    }
+
+    /* A faster system clock makes the delta shrink faster. */
+    global_offset_estimator.skew -= adjtimex_freq_to_ppm((long)(new_freq - freq)) / (1000 * 1000);
+    global_is_state_dirty = true;
+
+    LOG_WRITE_INFO("Adjusted clock frequency.  drift=%" NSEC_FMT " nsec over %" NSEC_FMT " nsec  error=%.3f ppm"
+            "  old=%.3f ppm  new=%.3f ppm", drift_nsec, elapsed_nsec, adjtimex_freq_to_ppm((long)error), 
+            adjtimex_freq_to_ppm(freq), adjtimex_freq_to_ppm((long)new_freq));
+    return 0;
+}
+
+static void record_delta_history(int64_t delta, int64_t delta_error) {
+    int64_t sys_nsec = -1;
+    if (get_system_now(&sys_nsec) != 0) {
+        return;
+    }
+
+    delta_history_t *history = &global_delta_history;
+    delta_history_entry_t *entry = &history->entries[history->next];
+    entry->sys_nsec = sys_nsec;
+    entry->delta_nsec = delta;
+    entry->error_nsec = delta_error;
+    history->next = (history->next + 1) % DELTA_HISTORY_LEN;
+    if (history->count < DELTA_HISTORY_LEN) {
+        history->count++;
+    }
+}
+
+/* boot_id must have room for 37 chars.  Returns 0 on success. */
+static int read_boot_id(char *boot_id) {
+    assert(boot_id);
+
+    boot_id[0] = '\0';
+    FILE *fp = fopen(BOOT_ID_FILE_NAME, "r");
+    if (!fp) {
+        LOG_WRITE_ERROR("Unable to open %s", BOOT_ID_FILE_NAME);
+        return -1;
+    }
+
+    int rc = (fscanf(fp, "%36s", boot_id) == 1) ? 0 : -1;
+    fclose(fp);
+    return rc;
+}
+
+/* Writes everything we've learned about the clocks to a temporary file and renames it over the state file, so a crash 
+   leaves either the old state or the new state but never half of each. */
+static int save_state() {
+    LOG_WRITE_VERBOSE_NARG("save_state");
+
+    char boot_id[37];
+    if (read_boot_id(boot_id) != 0) {
+        return -1;
+    }
+
+    const char *tmp_file_name = STATE_FILE_NAME ".tmp";
+    int fd = open(tmp_file_name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        LOG_WRITE_ERROR("Unable to open state file %s", tmp_file_name);
+        return -1;
+    }
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        LOG_WRITE_ERROR("Unable to fdopen state file %s", tmp_file_name);
+        close(fd);
+        return -1;
+    }
+
+    const rtc_phase_t *phase = &global_rtc_phase;
+    const freq_estimator_t *est = &global_freq_estimator;
+    fprintf(fp, "# " PROGRAM_NAME " state, rewritten automatically\n");
+    fprintf(fp, "version %d\n", STATE_FILE_VERSION);
+    fprintf(fp, "boot_id %s\n", boot_id);
+
+    long freq = 0;
+    if (global_is_freq_discipline_enabled && (get_kernel_frequency(&freq) == 0)) {
+        fprintf(fp, "frequency %ld\n", freq);
+    }
+
+    /* These are relative to CLOCK_MONOTONIC_RAW so they're only any use until the next boot. */
+    fprintf(fp, "rtc_phase %" PRId64 " %" PRId64 " %u %" PRId64 "\n", phase->anchor_mono_nsec, phase->anchor_rtc_nsec, 
+            phase->edge_count, phase->jitter_nsec);
+    if (global_slew.is_active) {
+        /* So that if we die mid-slew the next run can put the tick back. */
+        fprintf(fp, "slew_original_tick %ld\n", global_slew.original_tick);
+    }
+
+    if (est->has_reference) {
+        fprintf(fp, "freq_reference %" PRId64 " %" PRId64 " %" PRId64 "\n", est->reference_mono_nsec, 
+                est->reference_eventual_delta_nsec, est->adjusted_nsec);
+    }
+
+    const delta_history_t *history = &global_delta_history;
+    unsigned int i;
+    for (i = 0; i < history->count; i++) {
+        unsigned int index = (history->next + DELTA_HISTORY_LEN - history->count + i) % DELTA_HISTORY_LEN;
+        const delta_history_entry_t *entry = &history->entries[index];
+        fprintf(fp, "delta %" PRId64 " %" PRId64 " %" PRId64 "\n", entry->sys_nsec, entry->delta_nsec, 
+                entry->error_nsec);
+    }
+
+    bool is_ok = (fflush(fp) == 0) && (fsync(fd) == 0);
+    if (fclose(fp) != 0) {
+        is_ok = false;
+    }
+
+    if (!is_ok) {
+        LOG_WRITE_ERROR("Unable to write state file %s", tmp_file_name);
+        remove(tmp_file_name);
+        return -1;
+    }
+
+    if (rename(tmp_file_name, STATE_FILE_NAME) != 0) {
+        LOG_WRITE_ERROR("Unable to rename %s to %s", tmp_file_name, STATE_FILE_NAME);
+        remove(tmp_file_name);
+        return -1;
+    }
+
+    global_is_state_dirty = false;
+    return 0;
+}
+
+/* Saves the state if it has changed in an important way or if we haven't saved it for a while. */
+static void maybe_save_state(int64_t *last_save_mono_nsec) {
+    assert(last_save_mono_nsec);
+
+    int64_t mono_nsec = -1;
+    if (get_monotonic_now(&mono_nsec) != 0) {
+        return;
+    }
+
+    if (global_is_state_dirty || ((mono_nsec - *last_save_mono_nsec) >= sec_to_nsec(STATE_SAVE_INTERVAL_SEC))) {
+        /* Failing to save isn't fatal and we don't want to log the same error every loop. */
+        save_state();
+        *last_save_mono_nsec = mono_nsec;
+    }
+}
+
+/* Loads what we learned last time.  The frequency is useful after a reboot, everything else only within the same 
+   boot. */
+static void load_state() {
+    LOG_WRITE_VERBOSE_NARG("load_state");
+
+    FILE *fp = fopen(STATE_FILE_NAME, "r");
+    if (!fp) {
+        if (ENOENT != errno) {
+            LOG_WRITE_ERROR("Unable to open state file %s", STATE_FILE_NAME);
+        }
+
+        return;
+    }
+
+    char boot_id[37];
+    if (read_boot_id(boot_id) != 0) {
+        fclose(fp);
+        return;
+    }
+
+    int version = -1;
+    bool is_same_boot = false;
+    bool has_freq = false;
+    long freq = 0;
+    long slew_original_tick = 0;
+    rtc_phase_t phase = { 0, 0, 0, 0 };
+    freq_estimator_t est = { false, 0, 0, 0 };
+    delta_history_t history;
+    memset(&history, 0, sizeof(history));
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char saved_boot_id[37];
+        delta_history_entry_t entry;
+        if (sscanf(line, "version %d", &version) == 1) {
+            continue;
+        } else if (sscanf(line, "boot_id %36s", saved_boot_id) == 1) {
+            is_same_boot = (strcmp(boot_id, saved_boot_id) == 0);
+        } else if (sscanf(line, "frequency %ld", &freq) == 1) {
+            has_freq = true;
+        } else if (sscanf(line, "slew_original_tick %ld", &slew_original_tick) == 1) {
+            continue;
+        } else if (sscanf(line, "rtc_phase %" SCNd64 " %" SCNd64 " %u %" SCNd64, &phase.anchor_mono_nsec, 
+                &phase.anchor_rtc_nsec, &phase.edge_count, &phase.jitter_nsec) == 4) {
+            continue;
+        } else if (sscanf(line, "freq_reference %" SCNd64 " %" SCNd64 " %" SCNd64, &est.reference_mono_nsec, 
+                &est.reference_eventual_delta_nsec, &est.adjusted_nsec) == 3) {
+            est.has_reference = true;
+        } else if (sscanf(line, "delta %" SCNd64 " %" SCNd64 " %" SCNd64, &entry.sys_nsec, &entry.delta_nsec, 
+                &entry.error_nsec) == 3) {
+            history.entries[history.next] = entry;
+            history.next = (history.next + 1) % DELTA_HISTORY_LEN;
+            if (history.count < DELTA_HISTORY_LEN) {
+                history.count++;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    if (1 == version) {
+        phase.anchor_mono_nsec = usec_to_nsec(phase.anchor_mono_nsec);
+        phase.anchor_rtc_nsec = usec_to_nsec(phase.anchor_rtc_nsec);
+        phase.jitter_nsec = usec_to_nsec(phase.jitter_nsec);
+        est.reference_mono_nsec = usec_to_nsec(est.reference_mono_nsec);
+        est.reference_eventual_delta_nsec = usec_to_nsec(est.reference_eventual_delta_nsec);
+        est.adjusted_nsec = usec_to_nsec(est.adjusted_nsec);
+        unsigned int i;
+        for (i = 0; i < history.count; i++) {
+            history.entries[i].sys_nsec = usec_to_nsec(history.entries[i].sys_nsec);
+            history.entries[i].delta_nsec = usec_to_nsec(history.entries[i].delta_nsec);
+            history.entries[i].error_nsec = usec_to_nsec(history.entries[i].error_nsec);
+        }
+    } else if (STATE_FILE_VERSION != version) {
+        LOG_WRITE_ERROR_NO_ERRNO("Ignoring state file %s with unknown version %d", STATE_FILE_NAME, version);
+        return;
+    }
+
+    global_delta_history = history;
+    if (is_same_boot) {
+        global_rtc_phase = phase;
+        global_freq_estimator = est;
+    }
+
+    /* The last run died mid-slew.  A reboot puts the tick back by itself. */
+    if (is_same_boot && (slew_original_tick > 0) && (set_kernel_tick(slew_original_tick) == 0)) {
+        LOG_WRITE_INFO("Put the clock tick back after an unfinished slew.  tick=%ld usec", slew_original_tick);
+    }
+
+    if (global_is_freq_discipline_enabled && has_freq) {
+        /* After a reboot the kernel has forgotten the frequency, but if it's been set since then then somebody else 
+           is looking after it. */
+        long kernel_freq = 0;
+        if ((get_kernel_frequency(&kernel_freq) == 0) && (is_same_boot || (0 == kernel_freq)) && 
+                (kernel_freq != freq) && (set_kernel_frequency(freq) == 0)) {
+            LOG_WRITE_INFO("Restored clock frequency from %s.  freq=%.3f ppm", STATE_FILE_NAME, 
+                    adjtimex_freq_to_ppm(freq));
+        }
+    }
+
+    LOG_WRITE_INFO("Loaded state from %s.  same_boot=%d rtc_edges=%u deltas=%u", STATE_FILE_NAME, (int)is_same_boot, 
+            global_rtc_phase.edge_count, global_delta_history.count);
+}
+
+static int adjtime_set_time(int64_t delta) {
+    LOG_WRITE_VERBOSE("adjtime_set_time, delta=%" NSEC_FMT, delta);
+
+    if (0 == delta) {
+        LOG_WRITE_VERBOSE_NARG("0 == delta");
+    } else {
+        struct timeval old = { 0, 0 };
+        struct timeval tv;
+        epoch_nsec_to_tv(delta, &tv);
+        count_syscall();
+        if (global_backend->adjtime(&tv, &old) != 0) {
+            LOG_WRITE_ERROR("Unable to adjust time politely.  delta=%" NSEC_FMT " nsec", delta);
+            return -1;
+        }
+
+        int64_t old_delta = tv_to_epoch_nsec(&old);
+        note_adjustment(delta - old_delta);
+        LOG_WRITE_INFO("Time is adjusting politely.  delta=%" NSEC_FMT " nsec  old=%" NSEC_FMT " nsec", 
+                delta, old_delta);
+    }
+
+    return 0;
+}
+
+static int polite_set_time(int64_t delta) {
+    LOG_WRITE_VERBOSE("polite_set_time, delta=%" NSEC_FMT, delta);
+    PROBE1(polite_adjust, delta);
+
+    return (is_slew_engine_enabled() && (0 != delta)) ? start_slew(delta) : adjtime_set_time(delta);
+}
+
+/* Allows backward steps for a while, if the policy allows them after whatever just happened. */
+static void open_backward_step_window(backward_step_policy_t reason) {
+    int64_t mono_nsec = -1;
+    if (!(global_backward_step_policy & reason) || (get_monotonic_now(&mono_nsec) != 0)) {
+        return;
+    }
+
+    global_backward_step_window_end_mono_nsec = mono_nsec + sec_to_nsec(BACKWARD_STEP_WINDOW_SEC);
+    LOG_WRITE_VERBOSE("Backward steps allowed for the next %d seconds", BACKWARD_STEP_WINDOW_SEC);
+}
+
+static bool is_backward_step_allowed() {
+    if (global_backward_step_policy & BACKWARD_STEP_ALWAYS) {
+        return true;
+    }
+
+    int64_t mono_nsec = -1;
+    return (global_backward_step_window_end_mono_nsec >= 0) && (get_monotonic_now(&mono_nsec) == 0) && 
+            (mono_nsec < global_backward_step_window_end_mono_nsec);
+}
+
+/* CLOCK_REALTIME - CLOCK_MONOTONIC, which only changes when somebody sets the clock since slewing moves both. */
+static int get_realtime_offset_nsec(int64_t *offset_nsec) {
+    assert(offset_nsec);
+
+    struct timespec real_ts;
+    struct timespec mono_ts;
+    if ((global_backend->clock_gettime(CLOCK_REALTIME, &real_ts) != 0) || 
+            (global_backend->clock_gettime(CLOCK_MONOTONIC, &mono_ts) != 0)) {
+        LOG_WRITE_ERROR_NARG("clock_gettime(CLOCK_REALTIME or CLOCK_MONOTONIC) failed");
+        return -1;
+    }
+
+    *offset_nsec = ts_to_nsec(&real_ts) - ts_to_nsec(&mono_ts);
+    return 0;
+}
+
+/* Steps the clock by delta in one go.  The kernel adds the offset itself so, unlike reading the time and then setting 
+   it, there's no window where being preempted loses time. */
+static int step_clock(int64_t delta) {
+    /* ADJ_SETOFFSET wants the nanoseconds positive, which nsec_to_ts() takes care of. */
+    struct timespec ts;
+    nsec_to_ts(delta, &ts);
+    PROBE1(step, delta);
+
+    /* ADJ_NANO also sets STA_NANO, which switches the offset everybody else reads from adjtimex() to nanoseconds, so 
+       it's put back afterwards if it wasn't already set. */
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    count_syscall();
+    bool was_nano = (global_backend->clock_adjtime(CLOCK_REALTIME, &tx) >= 0) && (tx.status & STA_NANO);
+
+    memset(&tx, 0, sizeof(tx));
+    tx.modes = ADJ_SETOFFSET | ADJ_NANO;
+    tx.time.tv_sec = ts.tv_sec;
+    /* With ADJ_NANO the kernel reads tv_usec as nanoseconds. */
+    tx.time.tv_usec = ts.tv_nsec;
+    count_syscall();
+    int rc = global_backend->clock_adjtime(CLOCK_REALTIME, &tx);
+    if (!was_nano) {
+        memset(&tx, 0, sizeof(tx));
+        tx.modes = ADJ_MICRO;
+        count_syscall();
+        if (global_backend->clock_adjtime(CLOCK_REALTIME, &tx) < 0) {
+            LOG_WRITE_ERROR_NARG("Unable to put the clock back into microsecond mode");
+        }
+    }
+
+    if (rc < 0) {
+        return -1;
+    }
+
+    /* The step cancels the clock change timer too, and we don't want to throw away what we know because of it. */
+    global_is_own_step_pending = (get_realtime_offset_nsec(&global_own_step_offset_nsec) == 0);
+    return 0;
+}
+
+/* Returns 0 on success, >0 if delta is a backward step we aren't allowed to make, <0 on other error. */
+static int impolite_set_time(int64_t delta) {
+    LOG_WRITE_VERBOSE_NARG("impolite_set_time");
+
+    if ((delta < 0) && !is_backward_step_allowed()) {
+        global_metrics.refused_backward_steps++;
+        LOG_WRITE_ERROR("delta=%" NSEC_FMT " nsec, will not step the clock backwards.  Reboot recommended, or see -b.", 
+                delta);
+        return 1;
+    } 
+
+    /* delta includes whatever adjtime() or the tick slew still had to do, so cancel them rather than have them 
+       overshoot after the step. */
+    struct timeval zero = { 0, 0 };
+    struct timeval old = { 0, 0 };
+    count_syscall();
+    if (global_backend->adjtime(&zero, &old) != 0) {
+        LOG_WRITE_ERROR_NARG("Unable to cancel adjtime() before stepping");
+        return -1;
+    }
+
+    note_adjustment(-tv_to_epoch_nsec(&old));
+    stop_slew();
+
+    if (step_clock(delta) != 0) {
+        LOG_WRITE_ERROR("Unable to set time impolitely.  delta=%" NSEC_FMT " nsec", delta);
+        return -1;
+    }
+
+    note_adjustment(delta);
+    LOG_WRITE_INFO("Adjusted time impolitely.  delta=%" NSEC_FMT " nsec", delta);
+    return 0;
+}
+
+/* Sets the RTC to the system time at the next half second, so that its edges line up with the system clock's seconds.  
+   Returns 0 on success, >0 if we didn't manage to do it close enough to the half second, <0 on other error. */
+static int set_rtc_at_half_second() {
+    int64_t sys_nsec = -1;
+    if (get_system_now(&sys_nsec) != 0) {
+        return -1;
+    }
+
+    int64_t wait_nsec = RTC_SET_DELAY_NSEC - (sys_nsec - sec_to_nsec(nsec_to_sec(sys_nsec)));
+    if (wait_nsec < RTC_SET_SPIN_NSEC) {
+        wait_nsec += NSEC_PER_SEC;
+    }
+
+    const int64_t target_sys_nsec = sys_nsec + wait_nsec;
+    sleep_nsec(wait_nsec - RTC_SET_SPIN_NSEC);
+
+    begin_measurement_window();
+    do {
+        if (get_system_now(&sys_nsec) != 0) {
+            end_measurement_window();
+            return -1;
+        }
+    } while (sys_nsec < target_sys_nsec);
+
+    int64_t late_nsec = sys_nsec - target_sys_nsec;
+    if (late_nsec > RTC_SET_MAX_LATE_NSEC) {
+        end_measurement_window();
+        LOG_WRITE_VERBOSE("set_rtc_at_half_second: %" NSEC_FMT " nsec late, trying again", late_nsec);
+        return 1;
+    }
+
+    struct rtc_time rtct;
+    epoch_sec_to_rtc_time(nsec_to_sec(sys_nsec), &rtct);
+    count_syscall();
+    int rc = global_backend->set_rtc(&rtct);
+    end_measurement_window();
+    PROBE2(rtc_set, rc, sys_nsec);
+    if (rc != 0) {
+        LOG_WRITE_ERROR("Unable to set RTC via ioctl(%s)", "RTC_SET_TIME");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Everything we knew about the delta is wrong, eg because the RTC or the system clock moved under us. */
+static void forget_delta_estimates() {
+    memset(&global_offset_estimator, 0, sizeof(global_offset_estimator));
+    global_freq_estimator.has_reference = false;
+}
+
+/* Copies the system time to the RTC and checks it by measuring the delta at the RTC's next edge.  Every attempt counts 
+   towards rtc_writes or rtc_write_failures.  Returns 0 on success, >0 if it didn't work out, <0 on other error. */
+static int set_rtc_from_system() {
+    LOG_WRITE_VERBOSE_NARG("set_rtc_from_system");
+
+    get_monotonic_now(&global_rtc_stats.last_rtc_write_mono_nsec);
+    if (open_rtc() != 0) {
+        global_rtc_stats.rtc_write_failures++;
+        return -1;
+    }
+
+    int rc = 1;
+    int tries;
+    for (tries = 0; (tries < RTC_SET_MAX_TRIES) && (rc > 0) && !should_exit(); tries++) {
+        rc = set_rtc_at_half_second();
+    }
+
+    get_monotonic_now(&global_rtc_stats.last_rtc_write_mono_nsec);
+    if (rc != 0) {
+        global_rtc_stats.rtc_write_failures++;
+        LOG_WRITE_ERROR_NO_ERRNO("Unable to set the RTC within %d nsec of the half second", RTC_SET_MAX_LATE_NSEC);
+        return rc;
+    }
+
+    /* The RTC's edges have moved.  Whoever asked for the write forgets the delta estimates. */
+    rtc_phase_reset();
+
+    time_sample_t sample;
+    rc = get_edge_sample(&sample);
+    if (rc != 0) {
+        global_rtc_stats.rtc_write_failures++;
+        LOG_WRITE_ERROR_NO_ERRNO("Set the RTC but couldn't see it tick to check it.  rc=%d", rc);
+        return rc;
+    }
+
+    int64_t delta = calculate_delta(sample.hw_nsec, sample.sys_nsec);
+    if (llabs(delta) > msec_to_nsec(global_config.min_adjustment_delta_msec)) {
+        global_rtc_stats.rtc_write_failures++;
+        LOG_WRITE_ERROR_NO_ERRNO("Set the RTC but it's still %" NSEC_FMT " nsec out", delta);
+        return 1;
+    }
+
+    global_rtc_stats.rtc_writes++;
+    LOG_WRITE_INFO("Set the RTC from the system clock.  delta=%" NSEC_FMT " nsec error=%" NSEC_FMT " nsec", delta, 
+            sample.error_nsec);
+    return 0;
+}
+
+static bool sample_queue_push(sample_queue_t *queue, const measurement_t *measurement) {
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    if ((head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) >= SAMPLE_QUEUE_CAPACITY) {
+        return false;
+    }
+
+    queue->slots[head % SAMPLE_QUEUE_CAPACITY] = *measurement;
+    /* Release so that the consumer sees the slot filled in before it sees the new head. */
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool sample_queue_pop(sample_queue_t *queue, measurement_t *measurement) {
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail) {
+        return false;
+    }
+
+    *measurement = queue->slots[tail % SAMPLE_QUEUE_CAPACITY];
+    /* And so that the producer doesn't reuse the slot until we've copied it out. */
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void signal_eventfd(int fd) {
+    uint64_t one = 1;
+    count_syscall();
+    (void)!write(fd, &one, sizeof(one));
+}
+
+/* Sets one of the measurement thread's should_* flags and wakes it up. */
+static void ask_measurement_thread(bool *request) {
+    __atomic_store_n(request, true, __ATOMIC_RELEASE);
+    signal_eventfd(global_measurement_thread.wake_fd);
+}
+
+static bool take_request(bool *request) {
+    return __atomic_exchange_n(request, false, __ATOMIC_ACQUIRE);
+}
+
+/* Asks the measurement thread for a sample, noting when so that the watchdog can tell if it never comes. */
+static void ask_for_sample() {
+    measurement_thread_t *thread = &global_measurement_thread;
+    if (thread->owed_since_mono_nsec < 0) {
+        get_monotonic_now(&thread->owed_since_mono_nsec);
+    }
+
+    /* ask_measurement_thread()'s release publishes this along with the request. */
+    __atomic_add_fetch(&thread->measure_requests, 1, __ATOMIC_RELAXED);
+    ask_measurement_thread(&thread->should_measure);
+}
+
+/* A sample answers every request made before it was started.  If we've asked again since, the thread owes us another 
+   from now, since it's only just become free to take one. */
+static void note_sample_arrived(const measurement_t *measurement) {
+    measurement_thread_t *thread = &global_measurement_thread;
+    if (measurement->request > thread->answered_requests) {
+        thread->answered_requests = measurement->request;
+    }
+
+    thread->owed_since_mono_nsec = -1;
+    if (thread->answered_requests < thread->measure_requests) {
+        get_monotonic_now(&thread->owed_since_mono_nsec);
+    }
+}
+
+/* The longest a sample should take once the thread gets to it: a tick interrupt up to two seconds away plus its 
+   margin, then RTC_POLL_MAX_MSEC of polling if the interrupt doesn't come, after writing the RTC if we asked for 
+   that. */
+static int64_t get_max_measurement_nsec() {
+    const measurement_thread_t *thread = &global_measurement_thread;
+    int64_t max_nsec = sec_to_nsec(2) + (2 * rtc_tick_margin_nsec()) + msec_to_nsec(RTC_POLL_MAX_MSEC);
+    if (thread->rtc_write_requests > (global_rtc_stats.rtc_writes + global_rtc_stats.rtc_write_failures)) {
+        /* Each try waits for the system clock's next half second. */
+        max_nsec += RTC_SET_MAX_TRIES * (NSEC_PER_SEC + RTC_SET_DELAY_NSEC);
+    }
+
+    return max_nsec;
+}
+
+/* Whether it's fine to ping the systemd watchdog, which it isn't if the measurement thread has been stuck for longer 
+   than any sample can take, eg in a wedged RTC or PTP ioctl, so that systemd restarts us. */
+static bool is_measurement_thread_responsive() {
+    const measurement_thread_t *thread = &global_measurement_thread;
+    int64_t mono_nsec = -1;
+    if (!thread->is_running || (thread->owed_since_mono_nsec < 0) || (get_monotonic_now(&mono_nsec) != 0)) {
+        return true;
+    }
+
+    int64_t owed_nsec = mono_nsec - thread->owed_since_mono_nsec;
+    if (owed_nsec <= get_max_measurement_nsec()) {
+        return true;
+    }
+
+    LOG_WRITE_ERROR_NO_ERRNO("The measurement thread has owed us a sample for %" NSEC_FMT " nsec, not pinging the "
+            "watchdog", owed_nsec);
+    return false;
+}
+
+/* Gives the measurement thread a copy of global_config, which it picks up before it next does anything. */
+static void update_measurement_thread_config() {
+    measurement_thread_t *thread = &global_measurement_thread;
+    pthread_mutex_lock(&thread->config_lock);
+    thread->config = global_config;
+    thread->has_new_config = true;
+    pthread_mutex_unlock(&thread->config_lock);
+}
+
+/* Samples the delta the way set_time() does, but on the measurement thread. */
+static void take_measurement(measurement_t *measurement) {
+    assert(measurement);
+
+    memset(measurement, 0, sizeof(*measurement));
+    measurement->generation = __atomic_load_n(&global_measurement_thread.generation, __ATOMIC_ACQUIRE);
+    int64_t delta = 0;
+    int delta_rc = get_delta(&measurement->sample, &delta);
+    if ((delta_rc >= 0) && (get_monotonic_now(&measurement->mono_nsec) != 0)) {
+        delta_rc = -1;
+    }
+
+    measurement->delta_rc = delta_rc;
+    measurement->delta = (delta_rc >= 0) ? delta : 0;
+    measurement->rtc_phase = global_rtc_phase;
+    measurement->rtc_stats = global_rtc_stats;
+    measurement->ptp_method = global_ptp_method;
+}
+
+/* Blocks until the control thread asks for something.  Returns 0 unless it's time to stop. */
+static int wait_for_request(measurement_thread_t *thread) {
+    uint64_t wakeups;
+    count_syscall();
+    if (read(thread->wake_fd, &wakeups, sizeof(wakeups)) != sizeof(wakeups)) {
+        LOG_WRITE_ERROR_NARG("Unable to read the measurement thread's eventfd, stopping it");
+        return -1;
+    }
+
+    return take_request(&thread->should_stop) ? 1 : 0;
+}
+
+/* The measurement thread does nothing but what the control thread asks, and never logs unless something fails.  All 
+   signals are blocked so they go to the control thread. */
+static void *run_measurement_thread(void *arg) {
+    (void)arg;
+
+    measurement_thread_t *thread = &global_measurement_thread;
+    global_rtc_phase = thread->rtc_phase;
+    global_rtc_stats = thread->rtc_stats;
+    setup_low_jitter();
+    while (wait_for_request(thread) == 0) {
+        pthread_mutex_lock(&thread->config_lock);
+        if (thread->has_new_config) {
+            global_config = thread->config;
+            thread->has_new_config = false;
+        }
+
+        pthread_mutex_unlock(&thread->config_lock);
+
+        if (take_request(&thread->should_reset_rtc_phase)) {
+            rtc_phase_reset();
+        }
+
+        if (take_request(&thread->should_write_rtc)) {
+            set_rtc_from_system();
+        }
+
+        if (take_request(&thread->should_measure)) {
+            uint64_t request = __atomic_load_n(&thread->measure_requests, __ATOMIC_RELAXED);
+            measurement_t measurement;
+            take_measurement(&measurement);
+            measurement.request = request;
+            if (!sample_queue_push(&thread->queue, &measurement)) {
+                LOG_WRITE_ERROR_NO_ERRNO("Dropped a sample, the control thread is %d behind", SAMPLE_QUEUE_CAPACITY);
+            }
+
+            signal_eventfd(thread->sample_fd);
+        }
+    }
+
+    thread->rtc_phase = global_rtc_phase;
+    thread->rtc_stats = global_rtc_stats;
+    close_ptp();
+    close_rtc();
+    return NULL;
+}
+
+/* While NTP keeps the system clock right, -w copies it back to the RTC if the RTC has drifted, so that there's less to 
+   correct after the next boot or resume.  A delta from a PTP clock says nothing about the RTC, and one truncated to the 
+   second isn't good enough. */
+static void maybe_write_back_rtc(int delta_rc, int64_t delta, int64_t mono_nsec) {
+    if (!global_is_rtc_write_back_enabled || (0 != delta_rc) || (PTP_METHOD_NONE != global_ptp_method) || 
+            (llabs(delta) < msec_to_nsec(global_config.min_adjustment_delta_msec))) {
+        return;
+    }
+
+    const rtc_stats_t *rtc_stats = &global_rtc_stats;
+    if (((rtc_stats->rtc_writes + rtc_stats->rtc_write_failures) > 0) && 
+            ((mono_nsec - rtc_stats->last_rtc_write_mono_nsec) < sec_to_nsec(RTC_WRITE_BACK_MIN_INTERVAL_SEC))) {
+        LOG_WRITE_VERBOSE("RTC is %" NSEC_FMT " nsec out but we set it too recently", delta);
+        return;
+    }
+
+    measurement_thread_t *thread = &global_measurement_thread;
+    if (thread->is_running && (thread->rtc_write_requests > (rtc_stats->rtc_writes + rtc_stats->rtc_write_failures))) {
+        LOG_WRITE_VERBOSE("RTC is %" NSEC_FMT " nsec out but we've already asked for it to be set", delta);
+        return;
+    }
+
+    LOG_WRITE_INFO("RTC is %" NSEC_FMT " nsec out from the NTP synchronised system clock, setting it", delta);
+    if (thread->is_running) {
+        /* The control thread forgets the delta estimates when a sample shows the write happened. */
+        thread->rtc_write_requests = rtc_stats->rtc_writes + rtc_stats->rtc_write_failures + 1;
+        ask_measurement_thread(&thread->should_write_rtc);
+        return;
+    }
+
+    set_rtc_from_system();
+    forget_delta_estimates();
+}
+
+static int64_t max_polite_adjustment_delta_nsec() {
+    return sec_to_nsec(global_config.max_polite_adjustment_delta_sec);
+}
+
+/* If we've never seen the RTC tick then the hardware time is truncated to the second and we can't trust small deltas.  
+   Otherwise the estimate has to be clear of the threshold by more than it could be wrong by. */
+static int64_t get_min_adjustment_delta(const estimate_t *estimate) {
+    return estimate->is_precise ? 
+            (msec_to_nsec(global_config.min_adjustment_delta_msec) + (ESTIMATOR_CONFIDENCE_SIGMAS * estimate->sigma)) : 
+            sec_to_nsec(global_config.min_coarse_adjustment_delta_sec);
+}
+
+/* delta is our best guess at the delta now and current_adjtime_delta is how much of it is already being slewed away, 
+   so if what's left is small there's nothing more to do. */
+static set_time_action_t choose_action(int64_t delta, int64_t min_delta, int64_t current_adjtime_delta) {
+    if (llabs(delta - current_adjtime_delta) < min_delta) {
+        return (0 == current_adjtime_delta) ? SET_TIME_ACTION_NONE : SET_TIME_ACTION_ALREADY_ADJUSTING;
+    }
+
+    return (llabs(delta) <= max_polite_adjustment_delta_nsec()) ? SET_TIME_ACTION_POLITE : SET_TIME_ACTION_IMPOLITE;
+}
+
+/* The decision part of set_time().  Apart from feeding est it has no side effects, so that traces can be replayed 
+   through it.  Fills in result's estimate, min_delta and action from its sample and current_adjtime_delta. */
+static void decide(offset_estimator_t *est, set_time_result_t *result) {
+    assert(est);
+    assert(result);
+
+    bool is_precise = (0 == result->delta_rc);
+    int64_t pending_nsec = result->current_adjtime_delta;
+    /* A truncated hardware time is anywhere up to a second behind, so the delta is too. */
+    int64_t eventual_delta = result->delta - pending_nsec + (is_precise ? 0 : (NSEC_PER_SEC / 2));
+    int64_t error_nsec = is_precise ? result->delta_error : (NSEC_PER_SEC / 2);
+
+    estimate_t *estimate = &result->estimate;
+    estimate->is_outlier = !estimator_observe(est, result->mono_nsec, eventual_delta, error_nsec, is_precise);
+    estimate->eventual_delta = (int64_t)est->offset_nsec;
+    estimate->delta = estimate->eventual_delta + pending_nsec;
+    estimate->sigma = (int64_t)sqrt(est->offset_variance);
+    estimate->has_skew = est->samples >= 2;
+    estimate->skew = estimate->has_skew ? est->skew : 0;
+    estimate->is_precise = est->is_precise;
+
+    result->min_delta = get_min_adjustment_delta(estimate);
+    result->action = choose_action(estimate->delta, result->min_delta, pending_nsec);
+}
+
+static const char *set_time_action_to_string(set_time_action_t action) {
+    switch (action) {
+        case SET_TIME_ACTION_NONE:
+            return "none";
+
+        case SET_TIME_ACTION_ALREADY_ADJUSTING:
+            return "already_adjusting";
+
+        case SET_TIME_ACTION_POLITE:
+            return "polite";
+
+        case SET_TIME_ACTION_IMPOLITE:
+            return "impolite";
+
+        case SET_TIME_ACTION_DEFER_TO_NTP:
+            return "defer_to_ntp";
+    }
+
+    return "unknown";
+}
+
+static void init_set_time_result(set_time_result_t *result) {
+    assert(result);
+
+    memset(result, 0, sizeof(*result));
+    result->action = SET_TIME_ACTION_NONE;
+    result->current_adjtime_delta = TRACE_NO_ADJTIME_DELTA;
+}
+
+/* Once the clock has changed, samples that were already being taken are out of date.  Call after changing it. */
+static void invalidate_samples() {
+    __atomic_add_fetch(&global_measurement_thread.generation, 1, __ATOMIC_RELEASE);
+}
+
+/* What set_time() does after sampling, which is all the control thread does with a sample from the measurement thread.  
+   result's delta_rc, sample, delta and mono_nsec are filled in. */
+static int set_time_from_sample(set_time_result_t *result) {
+    assert(result);
+
+    int delta_rc = result->delta_rc;
+    if (delta_rc < 0) {
+        return -1;
+    }
+
+    int64_t delta = result->delta;
+    int64_t delta_error = result->sample.error_nsec;
+    result->delta_error = delta_error;
+
+    bool is_deferring_to_ntp = is_ntp_active();
+    if (is_deferring_to_ntp != global_is_deferring_to_ntp) {
+        global_is_deferring_to_ntp = is_deferring_to_ntp;
+        if (is_deferring_to_ntp) {
+            LOG_WRITE_INFO_NARG("Something else is synchronising the system clock, we'll just watch it");
+            stop_slew();
+        } else {
+            LOG_WRITE_INFO_NARG("Nothing else is synchronising the system clock any more, taking over");
+        }
+
+        /* Whatever the other thing did to the clock would look like drift. */
+        forget_delta_estimates();
+    }
+
+    if (is_deferring_to_ntp) {
+        result->action = SET_TIME_ACTION_DEFER_TO_NTP;
+        LOG_WRITE_VERBOSE("delta=%" NSEC_FMT " but deferring to NTP", delta);
+        maybe_write_back_rtc(delta_rc, delta, result->mono_nsec);
+        return 0;
+    }
+
+    int64_t current_adjtime_delta = INT64_MAX;
+    if (get_current_time_adjustment_delta(&current_adjtime_delta) != 0) {
+        return -1;
+    }
+
+    result->current_adjtime_delta = current_adjtime_delta;
+    decide(&global_offset_estimator, result);
+    const estimate_t *estimate = &result->estimate;
+    PROBE5(decide, result->action, delta, estimate->delta, estimate->sigma, result->min_delta);
+    if ((0 == delta_rc) && !estimate->is_outlier) {
+        record_delta_history(delta, delta_error);
+        if (global_is_freq_discipline_enabled) {
+            discipline_frequency(delta);
+        }
+    }
+
+    if ((SET_TIME_ACTION_NONE == result->action) || (SET_TIME_ACTION_ALREADY_ADJUSTING == result->action)) {
+        LOG_WRITE_VERBOSE("No work to do, estimated eventual_delta=%" NSEC_FMT " sigma=%" NSEC_FMT 
+                " which is less than threshold=%" NSEC_FMT " current_adjtime_delta=%" NSEC_FMT " delta_rc=%d", 
+                estimate->eventual_delta, estimate->sigma, result->min_delta, current_adjtime_delta, delta_rc);
+        return 0;
+    }
+
+    LOG_WRITE_VERBOSE("delta_rc=%d delta=%" NSEC_FMT " estimated_delta=%" NSEC_FMT " sigma=%" NSEC_FMT 
+            " nsec max_polite_delta=%" NSEC_FMT " nsec", delta_rc, delta, estimate->delta, estimate->sigma, 
+            max_polite_adjustment_delta_nsec());
+
+    int rc = (SET_TIME_ACTION_POLITE == result->action) ? polite_set_time(estimate->delta) : 
+            impolite_set_time(estimate->delta);
+    if (rc > 0) {
+        /* Still a failure to our callers, but polling faster won't change anybody's mind. */
+        result->is_backward_step_refused = true;
+        rc = -1;
+    }
+
+    invalidate_samples();
+    return rc;
+}
+
+static int set_time(set_time_result_t *result) {
+    LOG_WRITE_VERBOSE_NARG("set_time");
+
+    init_set_time_result(result);
+    int64_t delta;
+    result->delta_rc = get_delta(&result->sample, &delta);
+    if (result->delta_rc < 0) {
+        return -1;
+    }
+
+    if (get_monotonic_now(&result->mono_nsec) != 0) {
+        return -1;
+    }
+
+    result->delta = delta;
+    int rc = set_time_from_sample(result);
+    bool is_adjusted = (SET_TIME_ACTION_POLITE == result->action) || (SET_TIME_ACTION_IMPOLITE == result->action);
+    if ((0 == rc) && is_adjusted && global_is_verbose) {
+        LOG_WRITE_VERBOSE_NARG("set_time: success.  Will re-get times for the log");
+        time_sample_t sample;
+        get_times(&sample);
+    }
+
+    return rc;
+}
+
+/* Backs off the poll interval while the estimated delta is small and drifting slowly enough that it would still be 
+   small if we polled half as often, and snaps back to fast polling as soon as we have to do something or see an 
+   outlier, so that we soon find out whether the clock really jumped. */
+static void update_poll_interval(poll_state_t *poll, int set_time_rc, const set_time_result_t *result) {
+    assert(poll);
+    assert(result);
+
+    const estimate_t *estimate = &result->estimate;
+    /* While NTP is in charge we're only watching, so there's no hurry.  Nor is there when we've refused to step 
+       backwards, since nothing we see will change that until a reboot or the policy lets us. */
+    bool is_stable = (SET_TIME_ACTION_DEFER_TO_NTP == result->action) || result->is_backward_step_refused;
+    /* The estimate already allows for any slew in progress, so it's fine to back off while one finishes. */
+    bool is_waiting = (SET_TIME_ACTION_NONE == result->action) || 
+            (SET_TIME_ACTION_ALREADY_ADJUSTING == result->action);
+    if ((0 == set_time_rc) && (0 == result->delta_rc) && is_waiting && estimate->is_precise && estimate->has_skew && 
+            !estimate->is_outlier) {
+        double projected_delta = estimate->eventual_delta + (estimate->skew * sec_to_nsec(2 * poll->interval_sec));
+        is_stable = (projected_delta < result->min_delta) && (projected_delta > -result->min_delta);
+    }
+
+    if (is_stable) {
+        poll->stable_count++;
+        if ((poll->stable_count >= global_config.poll_backoff_samples) && 
+                (poll->interval_sec < global_config.max_poll_sec)) {
+            poll->interval_sec *= 2;
+            if (poll->interval_sec > global_config.max_poll_sec) {
+                poll->interval_sec = global_config.max_poll_sec;
+            }
+
+            poll->stable_count = 0;
+            LOG_WRITE_VERBOSE("Clock is stable, will poll every %d seconds", poll->interval_sec);
+        }
+    } else {
+        poll->stable_count = 0;
+        bool is_growing = (set_time_rc < 0) || (SET_TIME_ACTION_POLITE == result->action) || 
+                (SET_TIME_ACTION_IMPOLITE == result->action) || estimate->is_outlier;
+        if (is_growing && (poll->interval_sec != global_config.min_poll_sec)) {
+            poll->interval_sec = global_config.min_poll_sec;
+            LOG_WRITE_VERBOSE("Clock needs attention, will poll every %d seconds", poll->interval_sec);
+        }
+    }
+
+}
+
+static void close_trace() {
+    trace_t *trace = &global_trace;
+    if (trace->header) {
+        munmap(trace->header, trace->map_size);
+        trace->header = NULL;
+        trace->records = NULL;
+    }
+}
+
+static bool is_trace_header_valid(const trace_header_t *header, size_t file_size) {
+    return (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) == 0) && (TRACE_VERSION == header->version) && 
+            (sizeof(trace_record_t) == header->record_size) && (header->capacity > 0) && 
+            (file_size >= (sizeof(trace_header_t) + ((size_t)header->capacity * sizeof(trace_record_t))));
+}
+
+/* Maps a trace file into memory, creating it if necessary.  Recording into an existing trace carries on where it left 
+   off.  We don't keep the fd open because the mapping doesn't need it, and the System V daemon closes every fd when it 
+   starts.  Returns 0 on success. */
+static int open_trace(const char *file_name, bool is_writable) {
+    assert(file_name);
+
+    int fd = is_writable ? open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) : 
+            open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_WRITE_ERROR("Unable to open trace file %s", file_name);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOG_WRITE_ERROR("Unable to stat trace file %s", file_name);
+        close(fd);
+        return -1;
+    }
+
+    size_t map_size = (size_t)st.st_size;
+    bool is_new = map_size < sizeof(trace_header_t);
+    if (is_new) {
+        if (!is_writable) {
+            LOG_WRITE_ERROR_NO_ERRNO("Trace file %s is too short", file_name);
+            close(fd);
+            return -1;
+        }
+
+        map_size = sizeof(trace_header_t) + ((size_t)TRACE_CAPACITY * sizeof(trace_record_t));
+        if (ftruncate(fd, (off_t)map_size) != 0) {
+            LOG_WRITE_ERROR("Unable to size trace file %s", file_name);
+            close(fd);
+            return -1;
+        }
+    }
+
+    void *map = mmap(NULL, map_size, is_writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) {
+        LOG_WRITE_ERROR("Unable to mmap trace file %s", file_name);
+        return -1;
+    }
+
+    trace_t *trace = &global_trace;
+    trace->map_size = map_size;
+    trace->header = (trace_header_t *)map;
+    trace->records = (trace_record_t *)(trace->header + 1);
+    if (is_new) {
+        memcpy(trace->header->magic, TRACE_MAGIC, sizeof(trace->header->magic));
+        trace->header->version = TRACE_VERSION;
+        trace->header->record_size = sizeof(trace_record_t);
+        trace->header->capacity = TRACE_CAPACITY;
+        trace->header->next_index = 0;
+    }
+
+    if (!is_trace_header_valid(trace->header, map_size)) {
+        LOG_WRITE_ERROR_NO_ERRNO("%s isn't a version %d trace file", file_name, TRACE_VERSION);
+        close_trace();
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Costs a memcpy into the page cache, the kernel writes it out whenever it likes. */
+static void record_trace(int set_time_rc, const set_time_result_t *result, int poll_interval_sec) {
+    assert(result);
+
+    trace_t *trace = &global_trace;
+    if (!trace->header) {
+        return;
+    }
+
+    trace_record_t record;
+    record.mono_nsec = result->mono_nsec;
+    record.hw_nsec = result->sample.hw_nsec;
+    record.sys_nsec = result->sample.sys_nsec;
+    record.error_nsec = result->sample.error_nsec;
+    record.adjtime_delta_nsec = result->current_adjtime_delta;
+    record.hw_rc = result->delta_rc;
+    record.set_time_rc = set_time_rc;
+    record.action = result->action;
+    record.poll_interval_sec = poll_interval_sec;
+
+    uint64_t index = trace->header->next_index;
+    trace->records[index % trace->header->capacity] = record;
+    /* Only publish the record once it's all there. */
+    __atomic_store_n(&trace->header->next_index, index + 1, __ATOMIC_RELEASE);
+}
+
+/* Feeds every record in a trace through the same decision logic as set_time() and the poll interval logic, and 
+   reports where today's logic disagrees with what happened when the trace was recorded. */
+static int replay_trace(const char *file_name) {
+    if (open_trace(file_name, false) != 0) {
+        return -1;
+    }
+
+    const trace_header_t *header = global_trace.header;
+    uint64_t end = __atomic_load_n(&header->next_index, __ATOMIC_ACQUIRE);
+    uint64_t start = (end > header->capacity) ? (end - header->capacity) : 0;
+
+    poll_state_t poll = { global_config.min_poll_sec, 0 };
+    uint64_t action_mismatches = 0;
+    uint64_t poll_mismatches = 0;
+    uint64_t errors = 0;
+    uint64_t recorded_actions[SET_TIME_ACTION_DEFER_TO_NTP + 1] = { 0 };
+    uint64_t replayed_actions[SET_TIME_ACTION_DEFER_TO_NTP + 1] = { 0 };
+    offset_estimator_t est;
+    memset(&est, 0, sizeof(est));
+    uint64_t i;
+    for (i = start; i < end; i++) {
+        const trace_record_t *record = &global_trace.records[i % header->capacity];
+
+        set_time_result_t result;
+        memset(&result, 0, sizeof(result));
+        result.delta_rc = record->hw_rc;
+        result.sample.hw_nsec = record->hw_nsec;
+        result.sample.sys_nsec = record->sys_nsec;
+        result.sample.error_nsec = record->error_nsec;
+        result.mono_nsec = record->mono_nsec;
+        result.current_adjtime_delta = record->adjtime_delta_nsec;
+
+        int set_time_rc = record->set_time_rc;
+        if (record->hw_rc < 0) {
+            errors++;
+            result.action = SET_TIME_ACTION_NONE;
+        } else {
+            result.delta = calculate_delta(record->hw_nsec, record->sys_nsec);
+            result.delta_error = record->error_nsec;
+            /* If the recorded run didn't get as far as the adjtime() delta then assume nothing was pending. */
+            if (TRACE_NO_ADJTIME_DELTA == record->adjtime_delta_nsec) {
+                result.current_adjtime_delta = 0;
+            }
+
+            /* Whether NTP was running is an input rather than a decision, and the trace is all we know about it. */
+            if (SET_TIME_ACTION_DEFER_TO_NTP == record->action) {
+                memset(&est, 0, sizeof(est));
+                result.action = SET_TIME_ACTION_DEFER_TO_NTP;
+            } else {
+                decide(&est, &result);
+            }
+
+            /* The samples that follow reflect the correction the recorded run made, which was its estimate, and so 
+               ours too unless the logic has changed since. */
+            if ((0 == set_time_rc) && ((SET_TIME_ACTION_POLITE == record->action) || 
+                    (SET_TIME_ACTION_IMPOLITE == record->action))) {
+                est.offset_nsec -= result.estimate.eventual_delta;
+            }
+
+            if ((result.action >= SET_TIME_ACTION_NONE) && (result.action <= SET_TIME_ACTION_DEFER_TO_NTP)) {
+                replayed_actions[result.action]++;
+            }
+
+            if ((record->action >= SET_TIME_ACTION_NONE) && (record->action <= SET_TIME_ACTION_DEFER_TO_NTP)) {
+                recorded_actions[record->action]++;
+            }
+        }
+
+        /* The trace doesn't say why a step failed, but a backward one was almost certainly refused. */
+        result.is_backward_step_refused = (set_time_rc < 0) && (SET_TIME_ACTION_IMPOLITE == result.action) && 
+                (result.estimate.delta < 0);
+        update_poll_interval(&poll, set_time_rc, &result);
+
+        bool is_action_mismatch = (record->hw_rc >= 0) && ((int32_t)result.action != record->action);
+        bool is_poll_mismatch = poll.interval_sec != record->poll_interval_sec;
+        action_mismatches += is_action_mismatch ? 1 : 0;
+        poll_mismatches += is_poll_mismatch ? 1 : 0;
+        if (global_is_verbose || is_action_mismatch) {
+            printf("%" PRIu64 ": mono=%" NSEC_FMT " delta=%" NSEC_FMT " error=%" NSEC_FMT " hw_rc=%d"
+                    " recorded=%s/%ds replayed=%s/%ds%s\n", i, record->mono_nsec, result.delta, record->error_nsec, 
+                    record->hw_rc, set_time_action_to_string(record->action), record->poll_interval_sec, 
+                    set_time_action_to_string(result.action), poll.interval_sec, 
+                    is_action_mismatch ? "  ACTION DIFFERS" : "");
+        }
+    }
+
+    printf("records=%" PRIu64 " errors=%" PRIu64 " action_mismatches=%" PRIu64 " poll_interval_mismatches=%" PRIu64 
+            "\n", end - start, errors, action_mismatches, poll_mismatches);
+    int action;
+    for (action = SET_TIME_ACTION_NONE; action <= SET_TIME_ACTION_DEFER_TO_NTP; action++) {
+        printf("%-18s recorded=%" PRIu64 " replayed=%" PRIu64 "\n", set_time_action_to_string(action), 
+                recorded_actions[action], replayed_actions[action]);
+    }
+
+    close_trace();
+    return 0;
+}
+
+static int64_t get_cpu_nsec() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+    return tv_to_epoch_nsec(&usage.ru_utime) + tv_to_epoch_nsec(&usage.ru_stime);
+}
+
+static void metrics_observe_iteration(int set_time_rc, const set_time_result_t *result, int64_t cpu_nsec, 
+        uint64_t syscalls) {
+    assert(result);
+
+    metrics_t *metrics = &global_metrics;
+    metrics->iterations++;
+    histogram_observe(&metrics->iteration_cpu_seconds, nsec_to_seconds(cpu_nsec));
+    histogram_observe(&metrics->iteration_syscalls, (double)syscalls);
+
+    if (result->delta_rc >= 0) {
+        histogram_observe(&metrics->abs_delta_seconds, nsec_to_seconds(llabs(result->delta)));
+        metrics->has_last_delta = true;
+        metrics->last_delta_nsec = result->delta;
+        metrics->last_delta_error_nsec = result->delta_error;
+    }
+
+    /* Only decide() fills in the estimate. */
+    if ((result->delta_rc >= 0) && (TRACE_NO_ADJTIME_DELTA != result->current_adjtime_delta) && 
+            (SET_TIME_ACTION_DEFER_TO_NTP != result->action)) {
+        metrics->outliers += result->estimate.is_outlier ? 1 : 0;
+        metrics->has_estimate = true;
+        metrics->last_estimate = result->estimate;
+    }
+
+    if (set_time_rc < 0) {
+        metrics->errors++;
+    } else {
+        metrics->actions[result->action]++;
+    }
+}
+
+static void write_histogram(FILE *fp, const char *name, const char *help, const histogram_t *histogram) {
+    fprintf(fp, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s histogram\n", name, help, name);
+
+    uint64_t cumulative = 0;
+    int i;
+    for (i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        cumulative += histogram->counts[i];
+        fprintf(fp, METRICS_PREFIX "%s_bucket{le=\"%g\"} %" PRIu64 "\n", name, histogram->bounds[i], cumulative);
+    }
+
+    fprintf(fp, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, histogram->count);
+    fprintf(fp, METRICS_PREFIX "%s_sum %.9g\n", name, histogram->sum);
+    fprintf(fp, METRICS_PREFIX "%s_count %" PRIu64 "\n", name, histogram->count);
+}
+
+static void write_counter(FILE *fp, const char *name, const char *help, uint64_t value) {
+    fprintf(fp, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s counter\n" METRICS_PREFIX "%s %" PRIu64 
+            "\n", name, help, name, name, value);
+}
+
+static void write_gauge(FILE *fp, const char *name, const char *help, double value) {
+    fprintf(fp, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s gauge\n" METRICS_PREFIX "%s %.9g\n", 
+            name, help, name, name, value);
+}
+
+/* Writes the metrics in Prometheus text format for node_exporter's textfile collector, which wants the file replaced 
+   atomically. */
+static int write_metrics() {
+    LOG_WRITE_VERBOSE_NARG("write_metrics");
+
+    if (!global_metrics_file_name) {
+        return 0;
+    }
+
+    char tmp_file_name[PATH_MAX];
+    snprintf(tmp_file_name, sizeof(tmp_file_name), "%s.tmp", global_metrics_file_name);
+    FILE *fp = fopen(tmp_file_name, "w");
+    if (!fp) {
+        LOG_WRITE_ERROR("Unable to open metrics file %s", tmp_file_name);
+        return -1;
+    }
+
+    const metrics_t *metrics = &global_metrics;
+    const rtc_stats_t *rtc_stats = &global_rtc_stats;
+    write_histogram(fp, "abs_delta_seconds", "Absolute measured hardware minus system clock delta.", 
+            &metrics->abs_delta_seconds);
+    if (metrics->has_last_delta) {
+        write_gauge(fp, "delta_seconds", "Last measured hardware minus system clock delta.", 
+                nsec_to_seconds(metrics->last_delta_nsec));
+        write_gauge(fp, "delta_error_seconds", "How wrong the last measured delta could be.", 
+                nsec_to_seconds(metrics->last_delta_error_nsec));
+    }
+
+    if (metrics->has_estimate) {
+        write_gauge(fp, "estimated_delta_seconds", "Estimated hardware minus system clock delta.", 
+                nsec_to_seconds(metrics->last_estimate.delta));
+        write_gauge(fp, "estimated_delta_sigma_seconds", "Standard deviation of the estimated delta.", 
+                nsec_to_seconds(metrics->last_estimate.sigma));
+        write_gauge(fp, "estimated_skew_ppm", "Estimated rate at which the delta is growing.", 
+                metrics->last_estimate.skew * 1000 * 1000);
+    }
+
+    write_counter(fp, "outliers_total", "Samples ignored because they didn't fit the estimate.", metrics->outliers);
+    write_histogram(fp, "rtc_read_seconds", "Latency of ioctl(RTC_RD_TIME).", &rtc_stats->read_seconds);
+    write_histogram(fp, "tick_wait_seconds", "Time spent waiting for RTC tick interrupts that arrived.", 
+            &rtc_stats->tick_wait_seconds);
+    write_counter(fp, "tick_waits_total", "Times we waited for an RTC tick interrupt.", rtc_stats->tick_waits);
+    write_counter(fp, "tick_timeouts_total", "Times an RTC tick interrupt didn't arrive in time.", 
+            rtc_stats->tick_timeouts);
+    write_counter(fp, "poll_fallbacks_total", "Times we polled the RTC because a tick interrupt went missing.", 
+            rtc_stats->poll_fallbacks);
+    write_counter(fp, "poll_fallback_failures_total", "Times polling the RTC didn't see it tick over.", 
+            rtc_stats->poll_fallback_failures);
+    write_counter(fp, "rtc_writes_total", "Times we set the RTC from the system clock and it verified.", 
+            rtc_stats->rtc_writes);
+    write_counter(fp, "rtc_write_failures_total", "Times setting the RTC from the system clock failed.", 
+            rtc_stats->rtc_write_failures);
+
+    fprintf(fp, "# HELP " METRICS_PREFIX "decisions_total Decisions made after measuring the delta.\n"
+            "# TYPE " METRICS_PREFIX "decisions_total counter\n");
+    int action;
+    for (action = SET_TIME_ACTION_NONE; action <= SET_TIME_ACTION_DEFER_TO_NTP; action++) {
+        fprintf(fp, METRICS_PREFIX "decisions_total{action=\"%s\"} %" PRIu64 "\n", 
+                set_time_action_to_string(action), metrics->actions[action]);
+    }
+
+    write_gauge(fp, "deferring_to_ntp", "1 if something else is synchronising the system clock.", 
+            global_is_deferring_to_ntp ? 1 : 0);
+    write_counter(fp, "refused_backward_steps_total", "Times we refused to step the clock backwards.", 
+            metrics->refused_backward_steps);
+    write_counter(fp, "errors_total", "Iterations that failed.", metrics->errors);
+    write_counter(fp, "iterations_total", "Measure and adjust iterations.", metrics->iterations);
+    write_histogram(fp, "iteration_cpu_seconds", "CPU time used per iteration.", &metrics->iteration_cpu_seconds);
+    write_histogram(fp, "iteration_syscalls", "Syscalls made per iteration.", &metrics->iteration_syscalls);
+    write_counter(fp, "syscalls_total", "Syscalls made, not counting vDSO calls.", get_syscalls());
+    write_gauge(fp, "cpu_seconds", "Total CPU time used by the daemon.", nsec_to_seconds(get_cpu_nsec()));
+
+    if (fclose(fp) != 0) {
+        LOG_WRITE_ERROR("Unable to write metrics file %s", tmp_file_name);
+        remove(tmp_file_name);
+        return -1;
+    }
+
+    if (rename(tmp_file_name, global_metrics_file_name) != 0) {
+        LOG_WRITE_ERROR("Unable to rename %s to %s", tmp_file_name, global_metrics_file_name);
+        remove(tmp_file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void maybe_write_metrics(int64_t *last_write_mono_nsec) {
+    assert(last_write_mono_nsec);
+
+    int64_t mono_nsec = -1;
+    if (!global_metrics_file_name || (get_monotonic_now(&mono_nsec) != 0)) {
+        return;
+    }
+
+    if ((mono_nsec - *last_write_mono_nsec) >= sec_to_nsec(METRICS_WRITE_INTERVAL_SEC)) {
+        write_metrics();
+        *last_write_mono_nsec = mono_nsec;
+    }
+}
+
+/* Finds $NOTIFY_SOCKET and $WATCHDOG_USEC.  We talk the sd_notify() protocol ourselves rather than link libsystemd so 
+   that we still build on machines without systemd. */
+static void open_notify() {
+    const char *socket_name = getenv("NOTIFY_SOCKET");
+    if (!socket_name || !*socket_name) {
+        return;
+    }
+
+    size_t length = strlen(socket_name);
+    if ((('/' != socket_name[0]) && ('@' != socket_name[0])) || (length >= sizeof(global_notify_addr.sun_path))) {
+        LOG_WRITE_ERROR_NO_ERRNO("Ignoring unsupported NOTIFY_SOCKET=%s", socket_name);
+        return;
+    }
+
+    memset(&global_notify_addr, 0, sizeof(global_notify_addr));
+    global_notify_addr.sun_family = AF_UNIX;
+    memcpy(global_notify_addr.sun_path, socket_name, length);
+    if ('@' == socket_name[0]) {
+        /* An abstract socket, which isn't NUL terminated. */
+        global_notify_addr.sun_path[0] = '\0';
+    }
+
+    global_notify_addr_len = offsetof(struct sockaddr_un, sun_path) + length + (('@' == socket_name[0]) ? 0 : 1);
+    global_notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (global_notify_fd < 0) {
+        LOG_WRITE_ERROR_NARG("Unable to create notify socket");
+        return;
+    }
+
+    const char *watchdog_pid = getenv("WATCHDOG_PID");
+    const char *watchdog_usec = getenv("WATCHDOG_USEC");
+    if (watchdog_usec && (!watchdog_pid || (strtol(watchdog_pid, NULL, 10) == getpid()))) {
+        long long usec = strtoll(watchdog_usec, NULL, 10);
+        if (usec > 0) {
+            global_watchdog_interval_nsec = usec_to_nsec(usec) / 2;
+            LOG_WRITE_VERBOSE("Pinging the systemd watchdog every %" NSEC_FMT " nsec", global_watchdog_interval_nsec);
+        }
+    }
+}
+
+/* Sends one sd_notify() message, eg "READY=1".  It's only advice to systemd, so failures are just logged. */
+static void notify_systemd(const char *fmt, ...) {
+    if (global_notify_fd < 0) {
+        return;
+    }
+
+    char message[256];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    if ((length < 0) || ((size_t)length >= sizeof(message))) {
+        return;
+    }
+
+    count_syscall();
+    if (sendto(global_notify_fd, message, length, MSG_NOSIGNAL, (const struct sockaddr *)&global_notify_addr, 
+            global_notify_addr_len) != length) {
+        LOG_WRITE_ERROR("Unable to notify systemd of %s", message);
+    }
+}
+
+/* Tells systemd how we're doing after each iteration of the main loop, and that we're ready if is_ready. */
+static void notify_iteration(bool is_ready, const set_time_result_t *result, int interval_sec) {
+    assert(result);
+
+    if (global_notify_fd < 0) {
+        return;
+    }
+
+    const char *ready = is_ready ? "READY=1\n" : "";
+    if (result->delta_rc < 0) {
+        notify_systemd("%sWATCHDOG=1\nSTATUS=Unable to read the hardware clock, retrying in %d s", ready, 
+                interval_sec);
+    } else {
+        notify_systemd("%sWATCHDOG=1\nSTATUS=Offset %+.6f s, next poll in %d s", ready, 
+                nsec_to_seconds(result->delta), interval_sec);
+    }
+}
+
+static void close_event_loop(event_loop_t *loop) {
+    assert(loop);
+
+    if (-1 != loop->clock_change_fd) {
+        close(loop->clock_change_fd);
+        loop->clock_change_fd = -1;
+    }
+
+    if (-1 != loop->timer_fd) {
+        close(loop->timer_fd);
+        loop->timer_fd = -1;
+    }
+
+    if (-1 != loop->watchdog_fd) {
+        close(loop->watchdog_fd);
+        loop->watchdog_fd = -1;
+    }
+
+    if (-1 != loop->epoll_fd) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+}
+
+static int add_to_event_loop(const event_loop_t *loop, int fd) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        LOG_WRITE_ERROR("Unable to add fd %d to epoll", fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int get_suspended_nsec(int64_t *suspended_nsec) {
+    assert(suspended_nsec);
+
+    struct timespec boot_ts;
+    struct timespec mono_ts;
+    if ((global_backend->clock_gettime(CLOCK_BOOTTIME, &boot_ts) != 0) || 
+            (global_backend->clock_gettime(CLOCK_MONOTONIC, &mono_ts) != 0)) {
+        LOG_WRITE_ERROR_NARG("clock_gettime(CLOCK_BOOTTIME or CLOCK_MONOTONIC) failed");
+        return -1;
+    }
+
+    *suspended_nsec = ts_to_nsec(&boot_ts) - ts_to_nsec(&mono_ts);
+    return 0;
+}
+
+/* Arms a timer that never really expires but is cancelled as soon as anybody sets CLOCK_REALTIME. */
+static int arm_clock_change_timer(const event_loop_t *loop) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (clock_gettime(CLOCK_REALTIME, &its.it_value) != 0) {
+        LOG_WRITE_ERROR_NARG("clock_gettime(CLOCK_REALTIME) failed");
+        return -1;
+    }
+
+    its.it_value.tv_sec += CLOCK_CHANGE_TIMER_SEC;
+    count_syscall();
+    if (timerfd_settime(loop->clock_change_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) != 0) {
+        LOG_WRITE_ERROR_NARG("Unable to arm clock change timer");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Without the pings systemd would kill us, so unlike the clock change timer this one has to work. */
+static int open_watchdog_timer(event_loop_t *loop) {
+    loop->watchdog_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (loop->watchdog_fd < 0) {
+        LOG_WRITE_ERROR_NARG("timerfd_create(CLOCK_MONOTONIC) failed");
+        return -1;
+    }
+
+    struct itimerspec its;
+    nsec_to_ts(global_watchdog_interval_nsec, &its.it_value);
+    its.it_interval = its.it_value;
+    if (timerfd_settime(loop->watchdog_fd, 0, &its, NULL) != 0) {
+        LOG_WRITE_ERROR_NARG("Unable to arm watchdog timer");
+        return -1;
+    }
+
+    return add_to_event_loop(loop, loop->watchdog_fd);
+}
+
+static int open_event_loop(event_loop_t *loop) {
+    assert(loop);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timer_fd = -1;
+    loop->clock_change_fd = -1;
+    loop->watchdog_fd = -1;
+    loop->sample_fd = -1;
+    loop->suspended_nsec = 0;
+    sigprocmask(SIG_BLOCK, NULL, &loop->wait_sigmask);
+    sigdelset(&loop->wait_sigmask, SIGHUP);
+    if (loop->epoll_fd < 0) {
+        LOG_WRITE_ERROR_NARG("epoll_create1() failed");
+        return -1;
+    }
+
+    loop->timer_fd = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (loop->timer_fd < 0) {
+        LOG_WRITE_ERROR_NARG("timerfd_create(CLOCK_BOOTTIME) failed");
+        close_event_loop(loop);
+        return -1;
+    }
+
+    if (add_to_event_loop(loop, loop->timer_fd) != 0) {
+        close_event_loop(loop);
+        return -1;
+    }
+
+    /* Not being told about clock changes just means we notice them later, so carry on without it. */
+    loop->clock_change_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (loop->clock_change_fd < 0) {
+        LOG_WRITE_ERROR_NARG("timerfd_create(CLOCK_REALTIME) failed, clock changes won't be noticed straight away");
+    } else if ((arm_clock_change_timer(loop) != 0) || (add_to_event_loop(loop, loop->clock_change_fd) != 0)) {
+        close(loop->clock_change_fd);
+        loop->clock_change_fd = -1;
+    }
+
+    if ((global_watchdog_interval_nsec > 0) && (open_watchdog_timer(loop) != 0)) {
+        close_event_loop(loop);
+        return -1;
+    }
+
+    if (get_suspended_nsec(&loop->suspended_nsec) != 0) {
+        close_event_loop(loop);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int arm_poll_timer(const event_loop_t *loop, int64_t interval_nsec) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    nsec_to_ts(interval_nsec, &its.it_value);
+    count_syscall();
+    if (timerfd_settime(loop->timer_fd, 0, &its, NULL) != 0) {
+        LOG_WRITE_ERROR("Unable to arm poll timer.  interval=%" NSEC_FMT " nsec", interval_nsec);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Whether the clock change timer was cancelled by our own step_clock() rather than somebody else setting the clock.  If 
+   both happened before we looked the offset won't match and it counts as somebody else's. */
+static bool is_own_step() {
+    if (!global_is_own_step_pending) {
+        return false;
+    }
+
+    global_is_own_step_pending = false;
+    int64_t offset_nsec;
+    if (get_realtime_offset_nsec(&offset_nsec) != 0) {
+        return false;
+    }
+
+    int64_t drift_nsec = offset_nsec - global_own_step_offset_nsec;
+    return (drift_nsec > -OWN_STEP_MATCH_NSEC) && (drift_nsec < OWN_STEP_MATCH_NSEC);
+}
+
+static loop_event_t on_clock_change_timer(const event_loop_t *loop) {
+    uint64_t expirations;
+    count_syscall();
+    ssize_t rc = read(loop->clock_change_fd, &expirations, sizeof(expirations));
+    if ((rc < 0) && (EAGAIN == errno)) {
+        return LOOP_EVENT_NONE;
+    }
+
+    int read_errno = errno;
+    arm_clock_change_timer(loop);
+    if ((rc < 0) && (ECANCELED == read_errno)) {
+        if (is_own_step()) {
+            LOG_WRITE_VERBOSE_NARG("System clock was set by us");
+            return LOOP_EVENT_NONE;
+        }
+
+        LOG_WRITE_INFO_NARG("System clock was set, will resync now");
+        return LOOP_EVENT_CLOCK_SET;
+    }
+
+    return LOOP_EVENT_NONE;
+}
+
+static loop_event_t check_for_suspend(event_loop_t *loop) {
+    int64_t suspended_nsec;
+    if (get_suspended_nsec(&suspended_nsec) != 0) {
+        return LOOP_EVENT_NONE;
+    }
+
+    int64_t just_suspended_nsec = suspended_nsec - loop->suspended_nsec;
+    loop->suspended_nsec = suspended_nsec;
+    if (just_suspended_nsec < msec_to_nsec(MIN_SUSPEND_MSEC)) {
+        return LOOP_EVENT_NONE;
+    }
+
+    LOG_WRITE_INFO("System was suspended for %" NSEC_FMT " nsec, will resync now", just_suspended_nsec);
+    return LOOP_EVENT_RESUMED;
+}
+
+/* Sleeps until it's time to poll again, a sample has arrived or the clock has changed under us.  Returns a bitmask of 
+   loop_event_t, or <0 on error or if interrupted by a signal. */
+static int wait_for_event(event_loop_t *loop) {
+    struct epoll_event events[4];
+    count_syscall();
+    int n = epoll_pwait(loop->epoll_fd, events, sizeof(events) / sizeof(events[0]), -1, &loop->wait_sigmask);
+    if (n < 0) {
+        if (EINTR != errno) {
+            LOG_WRITE_ERROR_NARG("epoll_pwait() failed");
+        }
+
+        return -1;
+    }
+
+    int result = LOOP_EVENT_NONE;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (events[i].data.fd == loop->timer_fd) {
+            uint64_t expirations;
+            /* We need to read() the timerfd to reset it. */
+            count_syscall();
+            (void)!read(loop->timer_fd, &expirations, sizeof(expirations));
+            result |= LOOP_EVENT_POLL;
+        } else if (events[i].data.fd == loop->clock_change_fd) {
+            result |= on_clock_change_timer(loop);
+        } else if (events[i].data.fd == loop->watchdog_fd) {
+            uint64_t expirations;
+            count_syscall();
+            (void)!read(loop->watchdog_fd, &expirations, sizeof(expirations));
+            if (is_measurement_thread_responsive()) {
+                notify_systemd("WATCHDOG=1");
+            }
+        } else if (events[i].data.fd == loop->sample_fd) {
+            uint64_t samples;
+            count_syscall();
+            (void)!read(loop->sample_fd, &samples, sizeof(samples));
+            result |= LOOP_EVENT_SAMPLE;
+        }
+    }
+
+    result |= check_for_suspend(loop);
+    return result;
+}
+
+static void close_measurement_thread_fds() {
+    measurement_thread_t *thread = &global_measurement_thread;
+    if (-1 != thread->wake_fd) {
+        close(thread->wake_fd);
+        thread->wake_fd = -1;
+    }
+
+    if (-1 != thread->sample_fd) {
+        close(thread->sample_fd);
+        thread->sample_fd = -1;
+    }
+}
+
+/* Starts the measurement thread, handing it the phase tracker and RTC stats.  Returns 0 on success. */
+static int start_measurement_thread(event_loop_t *loop) {
+    assert(loop);
+
+    measurement_thread_t *thread = &global_measurement_thread;
+    thread->wake_fd = eventfd(0, EFD_CLOEXEC);
+    thread->sample_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if ((thread->wake_fd < 0) || (thread->sample_fd < 0)) {
+        LOG_WRITE_ERROR_NARG("Unable to create the measurement thread's eventfds");
+        close_measurement_thread_fds();
+        return -1;
+    }
+
+    if (add_to_event_loop(loop, thread->sample_fd) != 0) {
+        close_measurement_thread_fds();
+        return -1;
+    }
+
+    loop->sample_fd = thread->sample_fd;
+    thread->answered_requests = thread->measure_requests;
+    thread->owed_since_mono_nsec = -1;
+    /* We hardly allocate anything, and the arena glibc would give the thread reserves 64 MB that -R's mlockall() 
+       counts as locked. */
+    mallopt(M_ARENA_MAX, 1);
+    update_measurement_thread_config();
+    thread->rtc_phase = global_rtc_phase;
+    thread->rtc_stats = global_rtc_stats;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, MEASUREMENT_THREAD_STACK_BYTES);
+    /* The thread inherits our signal mask, so block everything while we create it. */
+    sigset_t all_signals;
+    sigset_t old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    int rc = pthread_create(&thread->thread, &attr, run_measurement_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        errno = rc;
+        LOG_WRITE_ERROR_NARG("Unable to start the measurement thread");
+        close_measurement_thread_fds();
+        return -1;
+    }
+
+    thread->is_running = true;
+    return 0;
+}
+
+/* Waits for the measurement thread to finish what it's doing, which could be waiting for a tick, and takes back the 
+   phase tracker and RTC stats. */
+static void stop_measurement_thread() {
+    measurement_thread_t *thread = &global_measurement_thread;
+    if (!thread->is_running) {
+        return;
+    }
+
+    ask_measurement_thread(&thread->should_stop);
+    pthread_join(thread->thread, NULL);
+    thread->is_running = false;
+    global_rtc_phase = thread->rtc_phase;
+    global_rtc_stats = thread->rtc_stats;
+    close_measurement_thread_fds();
+}
+
+/* The clock jumped (or we were asleep) so everything we learned about how it behaves is suspect. */
+static void on_clock_changed(poll_state_t *poll, int events) {
+    assert(poll);
+
+    stop_slew();
+    forget_delta_estimates();
+    invalidate_samples();
+    poll->interval_sec = global_config.min_poll_sec;
+    poll->stable_count = 0;
+
+    /* CLOCK_MONOTONIC_RAW stops while we're suspended but the RTC doesn't.  Setting CLOCK_REALTIME doesn't affect 
+       either of them so the phase is still good. */
+    if (events & LOOP_EVENT_RESUMED) {
+        if (global_measurement_thread.is_running) {
+            ask_measurement_thread(&global_measurement_thread.should_reset_rtc_phase);
+        } else {
+            rtc_phase_reset();
+        }
+
+        open_backward_step_window(BACKWARD_STEP_RESUME);
+    }
+}
+
+static const config_setting_t config_settings[] = {
+    { "min_adjustment_delta_msec", offsetof(config_t, min_adjustment_delta_msec), 1, 60 * 1000 },
+    { "min_coarse_adjustment_delta_sec", offsetof(config_t, min_coarse_adjustment_delta_sec), 1, 60 },
+    { "max_polite_adjustment_delta_sec", offsetof(config_t, max_polite_adjustment_delta_sec), 1, 60 * 60 },
+    { "min_poll_sec", offsetof(config_t, min_poll_sec), 1, 60 * 60 },
+    { "max_poll_sec", offsetof(config_t, max_poll_sec), 1, 24 * 60 * 60 },
+    { "poll_backoff_samples", offsetof(config_t, poll_backoff_samples), 1, 1000 },
+    { "rtc_tick_min_margin_msec", offsetof(config_t, rtc_tick_min_margin_msec), 1, 1000 }
+};
+
+static int set_config_setting(config_t *config, const char *name, const char *value) {
+    if (strcmp(name, "rtc_device") == 0) {
+        if (strlen(value) >= sizeof(config->rtc_device_name)) {
+            return -1;
+        }
+
+        snprintf(config->rtc_device_name, sizeof(config->rtc_device_name), "%s", value);
+        return 0;
+    }
+
+    size_t i;
+    for (i = 0; i < (sizeof(config_settings) / sizeof(config_settings[0])); i++) {
+        const config_setting_t *setting = &config_settings[i];
+        if (strcmp(name, setting->name) == 0) {
+            char *end = NULL;
+            long number = strtol(value, &end, 10);
+            if ((*end != '\0') || (number < setting->min) || (number > setting->max)) {
+                return -1;
+            }
+
+            *(int *)((char *)config + setting->offset) = (int)number;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Reads "name value" lines from file_name into config, with the defaults for anything not mentioned.  Returns 0 on 
+   success, >0 if the file doesn't exist (config gets the defaults), <0 if it's invalid (config is untouched). */
+static int read_config(const char *file_name, config_t *config) {
+    assert(config);
+
+    config_t new_config = CONFIG_INITIALIZER;
+    FILE *fp = fopen(file_name, "r");
+    if (!fp) {
+        if (ENOENT == errno) {
+            *config = new_config;
+            return 1;
+        }
+
+        LOG_WRITE_ERROR("Unable to open config file %s", file_name);
+        return -1;
+    }
+
+    int rc = 0;
+    int line_number = 0;
+    char line[256];
+    while ((0 == rc) && fgets(line, sizeof(line), fp)) {
+        line_number++;
+        line[strcspn(line, "#\n")] = '\0';
+        char name[64];
+        char value[128];
+        char extra[2];
+        int n = sscanf(line, "%63s %127s %1s", name, value, extra);
+        if (n <= 0) {
+            continue;
+        }
+
+        if ((n != 2) || (set_config_setting(&new_config, name, value) != 0)) {
+            LOG_WRITE_ERROR_NO_ERRNO("%s:%d: invalid setting: %s", file_name, line_number, line);
+            rc = -1;
+        }
+    }
+
+    fclose(fp);
+
+    if ((0 == rc) && (new_config.max_poll_sec < new_config.min_poll_sec)) {
+        LOG_WRITE_ERROR_NO_ERRNO("%s: max_poll_sec=%d is less than min_poll_sec=%d", file_name, 
+                new_config.max_poll_sec, new_config.min_poll_sec);
+        rc = -1;
+    }
+
+    if (0 == rc) {
+        *config = new_config;
+    }
+
+    return rc;
+}
+
+/* Reads the config file at startup.  Returns 0 on success. */
+static int load_config() {
+    if (!global_config_file_name) {
+        /* So that replays and simulations come out the same on any host, they only read a config file if told to. */
+        if ((RUN_MODE_REPLAY == global_run_mode) || (RUN_MODE_SIMULATE == global_run_mode)) {
+            return 0;
+        }
+
+        return (read_config(CONFIG_FILE_NAME, &global_config) < 0) ? -1 : 0;
+    }
+
+    /* The System V daemon changes directory, so remember where the file really is for reloads. */
+    static char path[PATH_MAX];
+    if (!realpath(global_config_file_name, path)) {
+        LOG_WRITE_ERROR("Unable to find config file %s", global_config_file_name);
+        return -1;
+    }
+
+    global_config_file_name = path;
+    return (read_config(global_config_file_name, &global_config) == 0) ? 0 : -1;
+}
+
+/* Re-reads the config file after a SIGHUP.  The new settings take effect all at once, or not at all if the file is 
+   invalid.  Nothing we've learned is lost. */
+static void reload_config(poll_state_t *poll) {
+    assert(poll);
+
+    const char *file_name = global_config_file_name ? global_config_file_name : CONFIG_FILE_NAME;
+    config_t config;
+    if (read_config(file_name, &config) < 0) {
+        LOG_WRITE_ERROR_NO_ERRNO("Keeping the current settings because %s is invalid", file_name);
+        return;
+    }
+
+    if (strcmp(config.rtc_device_name, global_config.rtc_device_name) != 0) {
+        LOG_WRITE_INFO("Restart to use rtc_device %s, still using %s", config.rtc_device_name, 
+                global_config.rtc_device_name);
+        memcpy(config.rtc_device_name, global_config.rtc_device_name, sizeof(config.rtc_device_name));
+    }
+
+    global_config = config;
+    if (global_measurement_thread.is_running) {
+        update_measurement_thread_config();
+    }
+
+    if (poll->interval_sec < config.min_poll_sec) {
+        poll->interval_sec = config.min_poll_sec;
+    } else if (poll->interval_sec > config.max_poll_sec) {
+        poll->interval_sec = config.max_poll_sec;
+    }
+
+    LOG_WRITE_INFO("Reloaded config from %s", file_name);
+}
+
+static void write_pid_file() {
+    int fd = open(PID_FILE_NAME, O_CREAT|O_EXCL|O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        LOG_WRITE_ERROR("Unable to open pid file %s", PID_FILE_NAME);
+        return;
+    } 
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        LOG_WRITE_ERROR("Unable to fdopen pid file %s", PID_FILE_NAME);
+        close(fd);
         return;
     }
 
@@ -594,37 +4621,409 @@ static void remove_pid_file() {
     remove(PID_FILE_NAME);
 }
 
+/* Brings the control thread's copies of the measurement state up to date from a sample. */
+static void update_measurement_state(const measurement_t *measurement) {
+    assert(measurement);
+
+    uint64_t rtc_writes = global_rtc_stats.rtc_writes + global_rtc_stats.rtc_write_failures;
+    global_rtc_phase = measurement->rtc_phase;
+    global_rtc_stats = measurement->rtc_stats;
+    global_ptp_method = measurement->ptp_method;
+    if ((global_rtc_stats.rtc_writes + global_rtc_stats.rtc_write_failures) != rtc_writes) {
+        /* The measurement thread set the RTC, which moved its edges. */
+        forget_delta_estimates();
+    }
+}
+
+static bool is_sample_current(const measurement_t *measurement) {
+    return measurement->generation == __atomic_load_n(&global_measurement_thread.generation, __ATOMIC_RELAXED);
+}
+
+/* The control thread: it asks the measurement thread for a sample whenever the poll timer fires or the clock changes, 
+   and decides what to do about each one as it arrives. */
 static void run_forever() {
     write_pid_file();
 
-    while (!global_should_exit) {
-        set_time();
-        if (!global_should_exit) {
-            LOG_WRITE_VERBOSE("Sleeping for %d seconds", LOOP_POLL_SEC);
-            sleep(LOOP_POLL_SEC);
+    event_loop_t loop;
+    if (open_event_loop(&loop) != 0) {
+        remove_pid_file();
+        return;
+    }
+
+    load_state();
+    open_backward_step_window(BACKWARD_STEP_STARTUP);
+    if (start_measurement_thread(&loop) != 0) {
+        close_event_loop(&loop);
+        remove_pid_file();
+        return;
+    }
+
+    int64_t last_save_mono_nsec = 0;
+    get_monotonic_now(&last_save_mono_nsec);
+    int64_t last_metrics_mono_nsec = 0;
+
+    poll_state_t poll = { global_config.min_poll_sec, 0 };
+    int iterations = 0;
+    bool is_ready = false;
+    /* An iteration runs from asking for a sample to dealing with it, so that it includes the measurement thread's 
+       share. */
+    int64_t start_cpu_nsec = get_cpu_nsec();
+    uint64_t start_syscalls = get_syscalls();
+    ask_for_sample();
+    while (!should_exit()) {
+        int events = wait_for_event(&loop);
+        if (events < 0) {
+            if (should_exit() || __atomic_load_n(&global_should_reload_config, __ATOMIC_RELAXED)) {
+                events = LOOP_EVENT_NONE;
+            } else {
+                /* Don't spin if the event loop is broken. */
+                sleep(global_config.min_poll_sec);
+                events = LOOP_EVENT_POLL;
+            }
+        }
+
+        if (events & (LOOP_EVENT_CLOCK_SET | LOOP_EVENT_RESUMED)) {
+            on_clock_changed(&poll, events);
+            events |= LOOP_EVENT_POLL;
+        }
+
+        if (__atomic_exchange_n(&global_should_reload_config, 0, __ATOMIC_RELAXED)) {
+            reload_config(&poll);
+        }
+
+        if (events & LOOP_EVENT_POLL) {
+            finish_slew_if_due();
+            start_cpu_nsec = get_cpu_nsec();
+            start_syscalls = get_syscalls();
+            ask_for_sample();
+        }
+
+        measurement_t measurement;
+        while (!should_exit() && sample_queue_pop(&global_measurement_thread.queue, &measurement)) {
+            note_sample_arrived(&measurement);
+            update_measurement_state(&measurement);
+            if (!is_sample_current(&measurement)) {
+                /* Whatever changed the clock also asked for a new sample or armed the poll timer. */
+                LOG_WRITE_VERBOSE_NARG("Ignoring a sample taken before the clock changed");
+                continue;
+            }
+
+            set_time_result_t result;
+            init_set_time_result(&result);
+            result.delta_rc = measurement.delta_rc;
+            result.sample = measurement.sample;
+            result.delta = measurement.delta;
+            result.mono_nsec = measurement.mono_nsec;
+            int rc = set_time_from_sample(&result);
+            update_poll_interval(&poll, rc, &result);
+            record_trace(rc, &result, poll.interval_sec);
+            maybe_save_state(&last_save_mono_nsec);
+            metrics_observe_iteration(rc, &result, get_cpu_nsec() - start_cpu_nsec, 
+                    get_syscalls() - start_syscalls);
+            maybe_write_metrics(&last_metrics_mono_nsec);
+            bool should_notify_ready = !is_ready && ((rc >= 0) || (++iterations >= NOTIFY_READY_MAX_ITERATIONS));
+            notify_iteration(should_notify_ready, &result, poll.interval_sec);
+            is_ready = is_ready || should_notify_ready;
+
+            int64_t sleep_nsec = get_slew_wait_nsec(sec_to_nsec(poll.interval_sec));
+            LOG_WRITE_VERBOSE("Sleeping for %" NSEC_FMT " nsec", sleep_nsec);
+            if (arm_poll_timer(&loop, sleep_nsec) != 0) {
+                /* Don't spin if the event loop is broken. */
+                sleep(global_config.min_poll_sec);
+                ask_for_sample();
+            }
         }
     }
 
+    notify_systemd("STOPPING=1");
+    stop_measurement_thread();
+    close_event_loop(&loop);
+
+    /* Don't leave the tick changed, but let adjtime() finish the job. */
+    int64_t remaining_nsec = stop_slew();
+    if (0 != remaining_nsec) {
+        adjtime_set_time(remaining_nsec);
+    }
+
+    save_state();
+    write_metrics();
     remove_pid_file();
+    LOG_WRITE_INFO("RTC stats: tick_waits=%" PRIu64 " tick_timeouts=%" PRIu64 " poll_fallbacks=%" PRIu64 
+            " poll_fallback_failures=%" PRIu64, global_rtc_stats.tick_waits, global_rtc_stats.tick_timeouts, 
+            global_rtc_stats.poll_fallbacks, global_rtc_stats.poll_fallback_failures);
     LOG_WRITE_INFO_NARG("Exiting");
 }
 
+static const sim_scenario_t sim_scenarios[] = {
+    { .name = "steady", .duration_sec = 4 * 60 * 60, .tick_latency_min_nsec = 50 * 1000, 
+            .tick_latency_max_nsec = 200 * 1000, .rtc_read_jitter_nsec = 20 * 1000, .max_converge_sec = 60, 
+            .max_mean_error_msec = 1, .max_wakeups = 320 },
+    { .name = "wsl2-drift", .duration_sec = 4 * 60 * 60, .sys_drift_ppm = -250, .rtc_drift_ppm = 5, 
+            .tick_latency_min_nsec = 200 * 1000, .tick_latency_max_nsec = 3000 * 1000, .tick_drop_probability = 0.02, 
+            .rtc_read_jitter_nsec = 200 * 1000, .max_converge_sec = 60, .max_mean_error_msec = 60, 
+            .max_wakeups = 2000 },
+    { .name = "offset-polite", .duration_sec = 4 * 60 * 60, .initial_offset_nsec = -3 * NSEC_PER_SEC, 
+            .sys_drift_ppm = 20, .tick_latency_min_nsec = 50 * 1000, .tick_latency_max_nsec = 200 * 1000, 
+            .rtc_read_jitter_nsec = 20 * 1000, .max_converge_sec = 2 * 60 * 60, .max_mean_error_msec = 800, 
+            .max_wakeups = 450 },
+    { .name = "offset-ahead", .duration_sec = 4 * 60 * 60, .initial_offset_nsec = 2 * NSEC_PER_SEC, 
+            .sys_drift_ppm = 20, .tick_latency_min_nsec = 50 * 1000, .tick_latency_max_nsec = 200 * 1000, 
+            .rtc_read_jitter_nsec = 20 * 1000, .max_converge_sec = 90 * 60, .max_mean_error_msec = 400, 
+            .max_wakeups = 450 },
+    { .name = "offset-impolite", .duration_sec = 4 * 60 * 60, .initial_offset_nsec = -60 * NSEC_PER_SEC, 
+            .sys_drift_ppm = 20, .tick_latency_min_nsec = 50 * 1000, .tick_latency_max_nsec = 200 * 1000, 
+            .rtc_read_jitter_nsec = 20 * 1000, .max_converge_sec = 60, .max_mean_error_msec = 60, 
+            .max_wakeups = 450 },
+    /* Backward steps aren't allowed, so all we can do is not make it worse, never step backwards and not keep polling 
+       fast for a step we'll never make. */
+    { .name = "ahead-impolite", .duration_sec = 4 * 60 * 60, .initial_offset_nsec = 60 * NSEC_PER_SEC, 
+            .sys_drift_ppm = 20, .tick_latency_min_nsec = 50 * 1000, .tick_latency_max_nsec = 200 * 1000, 
+            .rtc_read_jitter_nsec = 20 * 1000, .max_mean_error_msec = 61 * 1000, .max_wakeups = 450 },
+    { .name = "wsl2-ptp", .duration_sec = 4 * 60 * 60, .sys_drift_ppm = -250, .rtc_drift_ppm = 5, 
+            .tick_latency_min_nsec = 200 * 1000, .tick_latency_max_nsec = 3000 * 1000, .tick_drop_probability = 0.02, 
+            .rtc_read_jitter_nsec = 200 * 1000, .ptp_read_nsec = 5 * 1000, .max_converge_sec = 60, 
+            .max_mean_error_msec = 60, .max_wakeups = 2000 },
+    /* Every pause puts the clock out again, so it only converges after the last one. */
+    { .name = "vm-pause", .duration_sec = 4 * 60 * 60, .sys_drift_ppm = -100, .tick_latency_min_nsec = 200 * 1000, 
+            .tick_latency_max_nsec = 3000 * 1000, .rtc_read_jitter_nsec = 200 * 1000, .pause_interval_sec = 25 * 60, 
+            .pause_sec = 90, .max_converge_sec = 4 * 60 * 60, .max_mean_error_msec = 3000, .max_wakeups = 1100 },
+    { .name = "ntp-stops", .duration_sec = 4 * 60 * 60, .sys_drift_ppm = 100, .tick_latency_min_nsec = 50 * 1000, 
+            .tick_latency_max_nsec = 200 * 1000, .rtc_read_jitter_nsec = 20 * 1000, .ntp_sec = 60 * 60, 
+            .max_converge_sec = 3 * 60 * 60, .max_mean_error_msec = 120, .max_wakeups = 600 },
+    { .name = "dropped-uie", .duration_sec = 4 * 60 * 60, .sys_drift_ppm = 50, .tick_latency_min_nsec = 100 * 1000, 
+            .tick_latency_max_nsec = 500 * 1000, .tick_drop_probability = 0.5, .rtc_read_jitter_nsec = 50 * 1000, 
+            .max_converge_sec = 60, .max_mean_error_msec = 40, .max_wakeups = 650 }
+};
+
+/* How long the daemon's CLOCK_BOOTTIME poll timer for nsec really takes, which the tick stretches or shrinks.  The 
+   drift and frequency offset are left out so that the poll interval is the same with and without -f. */
+static int64_t sim_timer_to_true_nsec(int64_t nsec) {
+    return (int64_t)ceil(((double)nsec * get_base_tick()) / global_sim.tick);
+}
+
+/* Starts a scenario from scratch, forgetting everything the previous one taught us. */
+static void sim_start(const sim_scenario_t *scenario) {
+    close_rtc();
+    close_ptp();
+    global_is_ptp_unavailable = false;
+
+    sim_t *sim = &global_sim;
+    memset(sim, 0, sizeof(*sim));
+    sim->scenario = scenario;
+    sim->random_state = SIM_RANDOM_SEED;
+    sim->mono_nsec = sec_to_nsec(1000);
+    sim->rtc_nsec = sim_random_fraction() * sec_to_nsec(1);
+    sim->sys_nsec = sim->rtc_nsec + scenario->initial_offset_nsec;
+    sim->next_pause_true_nsec = sec_to_nsec(scenario->pause_interval_sec);
+    sim->tick = get_base_tick();
+    sim->status = (scenario->ntp_sec > 0) ? STA_PLL : STA_UNSYNC;
+
+    memset(&global_rtc_phase, 0, sizeof(global_rtc_phase));
+    rtc_stats_t rtc_stats = RTC_STATS_INITIALIZER;
+    global_rtc_stats = rtc_stats;
+    memset(&global_freq_estimator, 0, sizeof(global_freq_estimator));
+    memset(&global_offset_estimator, 0, sizeof(global_offset_estimator));
+    memset(&global_slew, 0, sizeof(global_slew));
+    global_backward_step_window_end_mono_nsec = -1;
+    global_is_deferring_to_ntp = false;
+    global_is_own_step_pending = false;
+    memset(&global_delta_history, 0, sizeof(global_delta_history));
+    metrics_t metrics = METRICS_INITIALIZER;
+    global_metrics = metrics;
+    global_is_state_dirty = false;
+}
+
+static void sim_observe_error(sim_report_t *report) {
+    const sim_t *sim = &global_sim;
+    double error_nsec = sim->sys_nsec - sim->rtc_nsec;
+    double abs_error_nsec = (error_nsec < 0) ? -error_nsec : error_nsec;
+    if (abs_error_nsec > report->max_abs_error_nsec) {
+        report->max_abs_error_nsec = abs_error_nsec;
+    }
+
+    if (abs_error_nsec > msec_to_nsec(SIM_CONVERGED_MSEC)) {
+        report->last_unconverged_true_nsec = sim->true_nsec;
+    }
+
+    report->sum_abs_error_nsec += abs_error_nsec;
+    report->error_samples++;
+    report->final_error_nsec = error_nsec;
+}
+
+/* The same loop as run_forever(), except that instead of sleeping we move the simulated clocks on, sampling the error 
+   as we go. */
+static void run_simulation(const sim_scenario_t *scenario, sim_report_t *report) {
+    memset(report, 0, sizeof(*report));
+    sim_start(scenario);
+    open_backward_step_window(BACKWARD_STEP_STARTUP);
+    sim_observe_error(report);
+
+    poll_state_t poll = { global_config.min_poll_sec, 0 };
+    const double end_true_nsec = sec_to_nsec(scenario->duration_sec);
+    while (!should_exit() && (global_sim.true_nsec < end_true_nsec)) {
+        uint64_t start_syscalls = get_syscalls();
+        finish_slew_if_due();
+        set_time_result_t result;
+        int rc = set_time(&result);
+        update_poll_interval(&poll, rc, &result);
+        record_trace(rc, &result, poll.interval_sec);
+        metrics_observe_iteration(rc, &result, 0, get_syscalls() - start_syscalls);
+        report->wakeups++;
+
+        /* What the daemon's clock change timer would tell it. */
+        if (global_sim.is_clock_set) {
+            global_sim.is_clock_set = false;
+            if (!is_own_step()) {
+                on_clock_changed(&poll, LOOP_EVENT_CLOCK_SET);
+            }
+        }
+
+        int64_t sleep_nsec = sim_timer_to_true_nsec(get_slew_wait_nsec(sec_to_nsec(poll.interval_sec)));
+        while (sleep_nsec > 0) {
+            int64_t step_nsec = (sleep_nsec < sec_to_nsec(SIM_ERROR_SAMPLE_SEC)) ? sleep_nsec : 
+                    sec_to_nsec(SIM_ERROR_SAMPLE_SEC);
+            sim_advance(step_nsec);
+            sim_observe_error(report);
+            sleep_nsec -= step_nsec;
+        }
+    }
+
+    stop_slew();
+    report->backward_steps = global_sim.backward_steps;
+}
+
+/* Prints why a run missed its scenario's limits, if it did.  Returns 0 if it didn't, >0 if it did. */
+static int check_simulation(const sim_scenario_t *scenario, bool is_freq, const sim_report_t *report) {
+    const char *name = scenario->name;
+    const char *flags = is_freq ? " -f" : "";
+    int rc = 0;
+    bool is_converged = (report->final_error_nsec > -msec_to_nsec(SIM_CONVERGED_MSEC)) && 
+            (report->final_error_nsec < msec_to_nsec(SIM_CONVERGED_MSEC));
+    if ((scenario->max_converge_sec > 0) && (!is_converged || 
+            (report->last_unconverged_true_nsec > sec_to_nsec(scenario->max_converge_sec)))) {
+        fprintf(stderr, "%s%s took longer than %" PRId64 " sec to converge\n", name, flags, scenario->max_converge_sec);
+        rc = 1;
+    }
+
+    if (report->sum_abs_error_nsec / report->error_samples > msec_to_nsec(scenario->max_mean_error_msec)) {
+        fprintf(stderr, "%s%s mean error was more than %" PRId64 " msec\n", name, flags, 
+                scenario->max_mean_error_msec);
+        rc = 1;
+    }
+
+    /* Doing nothing at all would leave the clock this far out, give or take the last poll interval's drift. */
+    double drift_ppm = fabs(scenario->sys_drift_ppm - scenario->rtc_drift_ppm);
+    double max_final_error_nsec = llabs(scenario->initial_offset_nsec) + 
+            ((drift_ppm * sec_to_nsec(scenario->duration_sec)) / (1000 * 1000)) + msec_to_nsec(SIM_CONVERGED_MSEC);
+    if (fabs(report->final_error_nsec) > max_final_error_nsec) {
+        fprintf(stderr, "%s%s ended up %.3f msec out, worse than doing nothing\n", name, flags, 
+                report->final_error_nsec / (1000 * 1000));
+        rc = 1;
+    }
+
+    if ((scenario->max_wakeups > 0) && (report->wakeups > scenario->max_wakeups)) {
+        fprintf(stderr, "%s%s woke up more than %" PRIu64 " times\n", name, flags, scenario->max_wakeups);
+        rc = 1;
+    }
+
+    if ((BACKWARD_STEP_NEVER == global_backward_step_policy) && (report->backward_steps > 0)) {
+        fprintf(stderr, "%s%s stepped the clock backwards %" PRIu64 " times without -b\n", name, flags, 
+                report->backward_steps);
+        rc = 1;
+    }
+
+    return rc;
+}
+
+/* Runs every scenario, or just the named one, with and without frequency discipline, and prints how well we did.  
+   Returns 0 if every run was within its scenario's limits, >0 if not, <0 on error. */
+static int run_simulations(const char *scenario_name) {
+    const size_t scenario_count = sizeof(sim_scenarios) / sizeof(sim_scenarios[0]);
+    size_t i;
+    for (i = 0; scenario_name && (i < scenario_count); i++) {
+        if (strcmp(scenario_name, sim_scenarios[i].name) == 0) {
+            break;
+        }
+    }
+
+    if (scenario_count == i) {
+        fprintf(stderr, "Unknown scenario: %s\n", scenario_name);
+        return -1;
+    }
+
+    const clock_backend_t *old_backend = global_backend;
+    const bool old_is_freq_discipline_enabled = global_is_freq_discipline_enabled;
+    global_backend = &sim_clock_backend;
+    global_is_log_muted = !global_is_verbose;
+    int rc = 0;
+
+    printf("%-16s %3s %10s %10s %11s %12s %8s %8s %8s %8s %8s %8s %9s %9s\n", "scenario", "-f", "converge_s", 
+            "max_err_ms", "mean_err_ms", "final_err_ms", "wakeups", "ticks", "timeouts", "rtc_irqs", "polite", 
+            "impolite", "syscalls", "speedup");
+
+    for (i = 0; !should_exit() && (i < scenario_count); i++) {
+        const sim_scenario_t *scenario = &sim_scenarios[i];
+        if (scenario_name && (strcmp(scenario_name, scenario->name) != 0)) {
+            continue;
+        }
+
+        int is_freq;
+        for (is_freq = 0; is_freq <= 1; is_freq++) {
+            global_is_freq_discipline_enabled = is_freq;
+            int64_t start_cpu_nsec = get_cpu_nsec();
+            sim_report_t report;
+            run_simulation(scenario, &report);
+            int64_t cpu_nsec = get_cpu_nsec() - start_cpu_nsec;
+
+            bool is_converged = (report.final_error_nsec > -msec_to_nsec(SIM_CONVERGED_MSEC)) && 
+                    (report.final_error_nsec < msec_to_nsec(SIM_CONVERGED_MSEC));
+            char converge_buf[32];
+            snprintf(converge_buf, sizeof(converge_buf), is_converged ? "%.0f" : "never", 
+                    report.last_unconverged_true_nsec / NSEC_PER_SEC);
+            printf("%-16s %3s %10s %10.3f %11.3f %12.3f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 
+                    " %8" PRIu64 " %9" PRIu64 " %8.0fx\n", scenario->name, is_freq ? "yes" : "no", converge_buf, 
+                    report.max_abs_error_nsec / (1000 * 1000), 
+                    (report.sum_abs_error_nsec / report.error_samples) / (1000 * 1000), 
+                    report.final_error_nsec / (1000 * 1000), report.wakeups, global_rtc_stats.tick_waits, 
+                    global_rtc_stats.tick_timeouts, global_sim.tick_interrupts, 
+                    global_metrics.actions[SET_TIME_ACTION_POLITE], 
+                    global_metrics.actions[SET_TIME_ACTION_IMPOLITE], get_syscalls(), 
+                    nsec_to_seconds(sec_to_nsec(scenario->duration_sec)) / nsec_to_seconds((cpu_nsec > 0) ? cpu_nsec : 1));
+            if (check_simulation(scenario, is_freq, &report) != 0) {
+                rc = 1;
+            }
+        }
+    }
+
+    close_rtc();
+    close_ptp();
+    global_is_ptp_unavailable = false;
+    global_backend = old_backend;
+    global_is_freq_discipline_enabled = old_is_freq_discipline_enabled;
+    global_is_log_muted = false;
+    return rc;
+}
+
 static void on_signal(int sig) {
     const char *unknown_signal = "Unknown signal!";
     switch (sig) {
         case SIGCHLD:
+            /* Explicitly ignore this. */
+            break;
+
         case SIGHUP:
-            /* Explicitly ignore these. */
+            __atomic_store_n(&global_should_reload_config, 1, __ATOMIC_RELAXED);
             break;
 
+        case SIGINT:
         case SIGTERM:
-            global_should_exit = true;
+            __atomic_store_n(&global_should_exit, 1, __ATOMIC_RELAXED);
             break;
 
         default:
             /* Should not be handled here. */            
             (void)!write(STDERR_FILENO, unknown_signal, strlen(unknown_signal));
-            global_should_exit = true;
+            __atomic_store_n(&global_should_exit, 1, __ATOMIC_RELAXED);
             break;
     }
 }
@@ -643,12 +5042,87 @@ static void set_signal_handler(int sig) {
 
 
 static void set_signal_handlers() {
+    /* SIGHUP only gets through while we're waiting in epoll_pwait(), so a reload never interrupts a measurement. */
+    sigset_t sighup;
+    sigemptyset(&sighup);
+    sigaddset(&sighup, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sighup, NULL);
+
     set_signal_handler(SIGCHLD);
     set_signal_handler(SIGHUP);
     set_signal_handler(SIGTERM);
 }
 
+/* At boot the system clock can be hours out (eg WSL2 after the host slept) and every second spent daemonizing and 
+   waiting for a tick is a second in which user shells see the wrong time.  So before we daemonize we read the hardware 
+   clock once without waiting for it to tick, and step the clock straight away if it's further out than a polite 
+   adjustment could fix.  Anything smaller is left for the first proper measurement. */
+static void boot_sync() {
+    LOG_WRITE_VERBOSE_NARG("boot_sync");
+
+    open_backward_step_window(BACKWARD_STEP_STARTUP);
+    if (is_ntp_active()) {
+        return;
+    }
+
+    int64_t delta = 0;
+    time_sample_t sample;
+    if ((open_ptp() == 0) && (get_ptp_sample(&sample) == 0)) {
+        delta = calculate_delta(sample.hw_nsec, sample.sys_nsec);
+    } else {
+        if ((read_rtc_as_epoch_nsec(&sample.hw_nsec) != 0) || (get_system_now(&sample.sys_nsec) != 0)) {
+            return;
+        }
+
+        /* Like decide(), allow for the RTC being anywhere in its second. */
+        delta = calculate_delta(sample.hw_nsec, sample.sys_nsec) + (NSEC_PER_SEC / 2);
+    }
+
+    if (llabs(delta) <= max_polite_adjustment_delta_nsec()) {
+        LOG_WRITE_VERBOSE("boot_sync: delta=%" NSEC_FMT " nsec, leaving it for the daemon", delta);
+        return;
+    }
+
+    LOG_WRITE_INFO("Clock is %" NSEC_FMT " nsec out at startup, stepping it before daemonizing", delta);
+    impolite_set_time(delta);
+}
+
+/* close_range() closes every fd in one syscall.  Looping up to _SC_OPEN_MAX instead can take over a million syscalls in 
+   containers with a high nofile limit, so on kernels without close_range() we close just the fds /proc says are 
+   open. */
+static void close_all_fds() {
+    if (close_range(0, ~0U, 0) == 0) {
+        return;
+    }
+
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            int fd = atoi(entry->d_name);
+            if (('.' != entry->d_name[0]) && (fd != dirfd(dir))) {
+                close(fd);
+            }
+        }
+
+        closedir(dir);
+        return;
+    }
+
+    int fd;
+    for (fd = sysconf(_SC_OPEN_MAX); fd >= 0; fd--) {
+        close(fd);
+    }
+}
+
 static void run_system_v() {
+    boot_sync();
+
+    /* The fds are about to be closed from under them. */
+    close_ptp();
+    close_rtc();
+    closelog();
+
     pid_t pid;
 
     pid = fork();
@@ -688,11 +5162,7 @@ static void run_system_v() {
         exit(EXIT_FAILURE);
     }
 
-    /* Close all open file descriptors */
-    int fd;
-    for (fd = sysconf(_SC_OPEN_MAX); fd >= 0; fd--) {
-        close(fd);
-    }
+    close_all_fds();
 
     openlog (PROGRAM_NAME, LOG_PID, LOG_DAEMON);
     LOG_WRITE_INFO_NARG("Started as a System V daemon");
@@ -701,10 +5171,198 @@ static void run_system_v() {
 
 static void run_systemd() {
     set_signal_handlers();
+    open_notify();
     LOG_WRITE_INFO_NARG("Started as a Systemd daemon");
     run_forever();
 }
 
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted values, of which there must be at least one. */
+static int64_t get_percentile(const int64_t *sorted, size_t count, unsigned int percent) {
+    size_t rank = ((count * percent) + 99) / 100;
+    return sorted[(rank > 0) ? (rank - 1) : 0];
+}
+
+/* Waits for one tick interrupt and works out how late it was compared to when the phase tracker expected it.  Returns 
+   0 on success, >0 if it timed out or there was nothing to compare it with yet, <0 on other error. */
+static int measure_tick_lateness(int64_t *lateness_nsec) {
+    assert(lateness_nsec);
+
+    if (enable_rtc_tick_interrupt() != 0) {
+        return 1;
+    }
+
+    rtc_edge_t edge = { -1, -1, 0 };
+    int rc = wait_for_rtc_tick_interrupt(&edge);
+    disable_rtc_tick_interrupt();
+    if (rc != 0) {
+        return rc;
+    }
+
+    int64_t rtc_nsec = -1;
+    if (read_rtc_as_epoch_nsec(&rtc_nsec) != 0) {
+        return -1;
+    }
+
+    const rtc_phase_t *phase = &global_rtc_phase;
+    bool has_prediction = phase->edge_count > 0;
+    int64_t predicted_mono_nsec = phase->anchor_mono_nsec + (rtc_nsec - phase->anchor_rtc_nsec);
+    rtc_phase_observe_edge(edge.mono_nsec, rtc_nsec);
+    if (!has_prediction || (llabs(edge.mono_nsec - predicted_mono_nsec) > RTC_PHASE_MAX_RESIDUAL_NSEC)) {
+        return 1;
+    }
+
+    *lateness_nsec = edge.mono_nsec - predicted_mono_nsec;
+    return 0;
+}
+
+static void print_measure_series(const measure_series_t *series) {
+    if (0 == series->count) {
+        if (global_is_measure_json) {
+            printf(", \"%s\": null", series->name);
+        } else {
+            printf("%-18s none\n", series->name);
+        }
+
+        return;
+    }
+
+    qsort(series->values, series->count, sizeof(series->values[0]), compare_int64);
+    int64_t min = series->values[0];
+    int64_t p50 = get_percentile(series->values, series->count, 50);
+    int64_t p99 = get_percentile(series->values, series->count, 99);
+    int64_t max = series->values[series->count - 1];
+    if (global_is_measure_json) {
+        printf(", \"%s\": { \"count\": %zu, \"min\": %" NSEC_FMT ", \"p50\": %" NSEC_FMT ", \"p99\": %" NSEC_FMT 
+                ", \"max\": %" NSEC_FMT " }", series->name, series->count, min, p50, p99, max);
+    } else {
+        printf("%-18s count=%-6zu min=%-12" NSEC_FMT " p50=%-12" NSEC_FMT " p99=%-12" NSEC_FMT " max=%" NSEC_FMT 
+                "\n", series->name, series->count, min, p50, p99, max);
+    }
+}
+
+/* Samples the clocks the way the daemon would, but never adjusts them, and prints the distribution of what we saw so 
+   that thresholds can be chosen for a new machine.  All times are in nsec. */
+static int run_measure() {
+    set_signal_handler(SIGINT);
+    set_signal_handler(SIGTERM);
+    setup_low_jitter();
+
+    const size_t capacity = global_measure_samples;
+    int64_t *values = calloc(4 * capacity, sizeof(int64_t));
+    if (!values) {
+        LOG_WRITE_ERROR_NARG("Unable to allocate memory for samples");
+        return -1;
+    }
+
+    /* Deltas truncated to the second because the tick didn't come are left out of delta and delta_error, and only 
+       counted. */
+    measure_series_t series[] = {
+        { "delta_nsec", values, 0 },
+        { "delta_error_nsec", values + capacity, 0 },
+        { "rtc_read_nsec", values + (2 * capacity), 0 },
+        { "tick_lateness_nsec", values + (3 * capacity), 0 }
+    };
+    uint64_t coarse_samples = 0;
+    uint64_t errors = 0;
+
+    int64_t start_mono_nsec = -1;
+    if ((open_rtc() != 0) || (get_monotonic_now(&start_mono_nsec) != 0)) {
+        free(values);
+        return -1;
+    }
+
+    const int64_t interval_nsec = sec_to_nsec(global_measure_duration_sec) / global_measure_samples;
+    int i;
+    for (i = 0; (i < global_measure_samples) && !should_exit(); i++) {
+        int64_t mono_nsec = -1;
+        if (get_monotonic_now(&mono_nsec) != 0) {
+            break;
+        }
+
+        int64_t due_mono_nsec = start_mono_nsec + (i * interval_nsec);
+        if (due_mono_nsec > mono_nsec) {
+            sleep_nsec(due_mono_nsec - mono_nsec);
+            if (should_exit()) {
+                break;
+            }
+        }
+
+        time_sample_t sample = { -1, -1, 0 };
+        int64_t delta = 0;
+        int rc = get_delta(&sample, &delta);
+        if (rc < 0) {
+            errors++;
+        } else if (rc > 0) {
+            coarse_samples++;
+        } else {
+            series[0].values[series[0].count++] = delta;
+            series[1].values[series[1].count++] = sample.error_nsec;
+        }
+
+        struct rtc_time rtct;
+        int64_t before_mono_nsec = -1;
+        int64_t after_mono_nsec = -1;
+        if ((get_monotonic_now(&before_mono_nsec) != 0) || (read_rtc(&rtct) != 0) || 
+                (get_monotonic_now(&after_mono_nsec) != 0)) {
+            errors++;
+        } else {
+            series[2].values[series[2].count++] = after_mono_nsec - before_mono_nsec;
+        }
+
+        int64_t lateness_nsec = 0;
+        rc = measure_tick_lateness(&lateness_nsec);
+        if (rc < 0) {
+            errors++;
+        } else if (0 == rc) {
+            series[3].values[series[3].count++] = lateness_nsec;
+        }
+
+        LOG_WRITE_VERBOSE("measure: sample=%d delta=%" NSEC_FMT " error=%" NSEC_FMT " rc=%d", i, delta, 
+                sample.error_nsec, rc);
+    }
+
+    const rtc_stats_t *rtc_stats = &global_rtc_stats;
+    double timeout_rate = (rtc_stats->tick_waits > 0) ? 
+            ((double)rtc_stats->tick_timeouts / rtc_stats->tick_waits) : 0;
+    if (global_is_measure_json) {
+        printf("{ \"samples\": %d, \"coarse_samples\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"ptp_device\": ", i, 
+                coarse_samples, errors);
+        if (PTP_METHOD_NONE == global_ptp_method) {
+            printf("null");
+        } else {
+            printf("\"%s\"", global_ptp_device_name);
+        }
+    } else {
+        printf("samples=%d coarse_samples=%" PRIu64 " errors=%" PRIu64 " ptp_device=%s\n", i, coarse_samples, errors, 
+                (PTP_METHOD_NONE == global_ptp_method) ? "none" : global_ptp_device_name);
+    }
+
+    size_t j;
+    for (j = 0; j < (sizeof(series) / sizeof(series[0])); j++) {
+        print_measure_series(&series[j]);
+    }
+
+    if (global_is_measure_json) {
+        printf(", \"tick_waits\": %" PRIu64 ", \"tick_timeouts\": %" PRIu64 ", \"tick_timeout_rate\": %.6f"
+                ", \"poll_fallbacks\": %" PRIu64 ", \"poll_fallback_failures\": %" PRIu64 " }\n", 
+                rtc_stats->tick_waits, rtc_stats->tick_timeouts, timeout_rate, rtc_stats->poll_fallbacks, 
+                rtc_stats->poll_fallback_failures);
+    } else {
+        printf("tick_waits=%" PRIu64 " tick_timeouts=%" PRIu64 " tick_timeout_rate=%.6f poll_fallbacks=%" PRIu64 
+                " poll_fallback_failures=%" PRIu64 "\n", rtc_stats->tick_waits, rtc_stats->tick_timeouts, 
+                timeout_rate, rtc_stats->poll_fallbacks, rtc_stats->poll_fallback_failures);
+    }
+
+    free(values);
+    return (0 == i) ? -1 : 0;
+}
+
 static int run() {
     switch (global_run_mode) {
         case RUN_MODE_SYSTEM_V:
@@ -715,8 +5373,29 @@ static int run() {
             run_systemd();
             return 0;
 
-        case RUN_MODE_ONCE:
-            return set_time();
+        case RUN_MODE_ONCE: {
+            setup_low_jitter();
+            open_backward_step_window(BACKWARD_STEP_STARTUP);
+            set_time_result_t result;
+            int rc = set_time(&result);
+            record_trace(rc, &result, 0);
+            metrics_observe_iteration(rc, &result, get_cpu_nsec(), get_syscalls());
+            write_metrics();
+            return rc;
+        }
+
+        case RUN_MODE_REPLAY:
+            return replay_trace(global_trace_file_name);
+
+        case RUN_MODE_SIMULATE:
+            return run_simulations(global_sim_scenario_name);
+
+        case RUN_MODE_MEASURE:
+            return run_measure();
+
+        case RUN_MODE_SYSTOHC:
+            setup_low_jitter();
+            return set_rtc_from_system();
     }
 
     assert(false);
@@ -724,24 +5403,96 @@ static int run() {
 }
     
 
+/* Parses a comma separated list like "startup,resume".  Returns 0 on success. */
+static int parse_backward_step_policy(const char *text, unsigned int *policy) {
+    static const struct {
+        const char *name;
+        backward_step_policy_t flag;
+    } names[] = {
+        { "never", BACKWARD_STEP_NEVER },
+        { "startup", BACKWARD_STEP_STARTUP },
+        { "resume", BACKWARD_STEP_RESUME },
+        { "always", BACKWARD_STEP_ALWAYS }
+    };
+
+    *policy = BACKWARD_STEP_NEVER;
+    while (*text) {
+        size_t len = strcspn(text, ",");
+        size_t i;
+        for (i = 0; i < (sizeof(names) / sizeof(names[0])); i++) {
+            if ((strlen(names[i].name) == len) && (strncmp(text, names[i].name, len) == 0)) {
+                *policy |= names[i].flag;
+                break;
+            }
+        }
+
+        if ((sizeof(names) / sizeof(names[0])) == i) {
+            return -1;
+        }
+
+        text += len;
+        text += (',' == *text) ? 1 : 0;
+    }
+
+    return 0;
+}
+
 void print_usage(const char *argv[]) {
     fprintf(stderr, 
-            "%s <systemv|systemd|once> [-v]\n\nLike hwclock -s, but gradually like ntpd if the time delta <= %d second(s).\n"
-                "Will take no action if the delta is less than %d second(s).\n" 
-                "Will poll for clock deltas every %d second(s).\n"
-                "Will refuse to jolt the clock backwards.\n"
+            "%s <systemv|systemd|once> [-v] [-f] [-w] [-C config_file] [-s ppm] [-b policy] [-p ptp_device]\n"
+            "    [-R priority] [-c cpu] [-r trace_file] [-m metrics_file]\n"
+            "%s replay trace_file [-v] [-C config_file]\n"
+            "%s simulate [scenario] [-v] [-C config_file] [-s ppm] [-b policy] [-r trace_file]\n"
+            "%s measure [-n samples] [-d duration_sec] [-j] [-v] [-C config_file] [-p ptp_device] [-R priority]\n"
+            "    [-c cpu]\n"
+            "%s systohc [-v] [-C config_file] [-R priority] [-c cpu]\n\nLike hwclock -s, but gradually like ntpd if the time delta <= %d second(s).\n"
+                "Will take no action if the delta is less than %d msec, or %d second(s) if the clock tick was missed.\n" 
+                "Will poll for clock deltas every %d second(s), backing off to every %d seconds while the clock is stable.\n"
+                "Will refuse to jolt the clock backwards unless -b allows it.\n"
+                "The thresholds and polling intervals are defaults which %s can change.\n"
                 "Assumes that hardware clock is in UTC.\n"
                 "\n"
                 "systemv: run as a System V daemon.  Useful on WSL2 which doesn't tend to have Systemd.\n"
                 "systemd: run as a Systemd daemon (ie log to stderr & don't detach).\n"
                 "once:    just check & adjust the time once.\n"
-                "-v:      verbose output.\n", 
-            argv[0], MAX_POLITE_ADJUSTMENT_DELTA_SEC, MIN_ADJUSTMENT_DELTA_SEC, LOOP_POLL_SEC);
+                "replay:  run a trace recorded with -r through the decision logic without touching the clock, and\n"
+                "         report where it would now decide differently.  -v reports every record.\n"
+                "simulate: run the daemon's logic against simulated clocks (drift, dropped tick interrupts, VM pauses\n"
+                "         etc) much faster than real time, and report convergence time, error and wakeups for each\n"
+                "         scenario.  Never touches the real clock.\n"
+                "measure: take samples (default %d) spread over duration_sec (default %d) without touching the clock,\n"
+                "         and report percentiles of the delta, RTC_RD_TIME latency and tick interrupt lateness, and\n"
+                "         how often tick interrupts timed out.  -j reports in JSON.\n"
+                "systohc: set the RTC from the system clock, timed so that their seconds line up, and check it.\n"
+                "-v:      verbose output.\n"
+                "-C:      read settings from config_file instead of %s.  The daemon re-reads it\n"
+                "         on SIGHUP.\n"
+                "-f:      also correct the system clock's frequency error with adjtimex(), so that steady drift\n"
+                "         doesn't need repeated adjustments.  Only useful when running as a daemon.\n"
+                "-w:      while NTP is synchronising the system clock, set the RTC from it (at most hourly) if they're\n"
+                "         further apart than the adjustment threshold, so that there's less to correct after a reboot\n"
+                "         or resume.  Not when using a PTP clock.\n"
+                "-s:      slew polite adjustments at this many ppm (up to %d) by changing the kernel's tick length,\n"
+                "         rather than at adjtime()'s %d ppm.  Only when running as a daemon.\n"
+                "-b:      when to allow stepping the clock backwards: never (the default), or any of startup and\n"
+                "         resume (for %d seconds afterwards) or always, eg startup,resume.\n"
+                "-p:      use this PTP clock (eg /dev/ptp0) instead of the RTC, \"auto\" (the default) to use a\n"
+                "         Hyper-V, KVM or VMware host clock if there is one, or \"none\" to always use the RTC.\n"
+                "-R:      measure at this SCHED_FIFO priority (1-99) and lock the daemon's memory so that system load\n"
+                "         and page faults don't add noise to the measurements.  Decisions and logging run at normal\n"
+                "         priority.\n"
+                "-c:      pin to this CPU.\n"
+                "-r:      record every measurement and decision to a memory-mapped ring in trace_file.\n"
+                "-m:      write Prometheus metrics to metrics_file (eg for node_exporter's textfile collector).\n", 
+            argv[0], argv[0], argv[0], argv[0], argv[0], MAX_POLITE_ADJUSTMENT_DELTA_SEC, MIN_ADJUSTMENT_DELTA_MSEC, 
+            MIN_COARSE_ADJUSTMENT_DELTA_SEC, MIN_LOOP_POLL_SEC, MAX_LOOP_POLL_SEC, CONFIG_FILE_NAME, MEASURE_SAMPLES, 
+            MEASURE_DURATION_SEC, CONFIG_FILE_NAME, 
+            MAX_SLEW_PPM, ADJTIME_SLEW_PPM, BACKWARD_STEP_WINDOW_SEC);
 }
 
 
 int main(int argc, const char *argv[]) {
-    if ((argc != 2) && (argc != 3)) {
+    if (argc < 2) {
         print_usage(argv);
         return -1;
     }
@@ -753,24 +5504,123 @@ int main(int argc, const char *argv[]) {
         global_run_mode = RUN_MODE_SYSTEMD;
     } else if (strcmp(mode, "once") == 0) {
         global_run_mode = RUN_MODE_ONCE;
+    } else if ((strcmp(mode, "replay") == 0) && (argc >= 3)) {
+        global_run_mode = RUN_MODE_REPLAY;
+        global_trace_file_name = argv[2];
+    } else if (strcmp(mode, "simulate") == 0) {
+        global_run_mode = RUN_MODE_SIMULATE;
+        if ((argc >= 3) && (argv[2][0] != '-')) {
+            global_sim_scenario_name = argv[2];
+        }
+    } else if (strcmp(mode, "measure") == 0) {
+        global_run_mode = RUN_MODE_MEASURE;
+    } else if (strcmp(mode, "systohc") == 0) {
+        global_run_mode = RUN_MODE_SYSTOHC;
     } else {
         fprintf(stderr, "Invalid mode: %s\n", mode);
         print_usage(argv);
         return -1;
     }
 
-    if (3 == argc) {        
-        if (strcmp(argv[2], "-v") == 0) {
+    /* Options for when we're keeping the system clock in sync, for real or in simulation. */
+    const bool is_syncing = (RUN_MODE_REPLAY != global_run_mode) && (RUN_MODE_MEASURE != global_run_mode) && 
+            (RUN_MODE_SYSTOHC != global_run_mode);
+    int i;
+    for (i = ((RUN_MODE_REPLAY == global_run_mode) || global_sim_scenario_name) ? 3 : 2; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
             global_is_verbose = true;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            global_is_freq_discipline_enabled = true;
+        } else if ((strcmp(argv[i], "-C") == 0) && ((i + 1) < argc)) {
+            global_config_file_name = argv[++i];
+        } else if ((strcmp(argv[i], "-m") == 0) && ((i + 1) < argc) && is_syncing) {
+            global_metrics_file_name = argv[++i];
+        } else if ((strcmp(argv[i], "-s") == 0) && ((i + 1) < argc) && is_syncing) {
+            char *end = NULL;
+            global_slew_ppm = strtoll(argv[++i], &end, 10);
+            if ((*end != '\0') || (global_slew_ppm < ADJTIME_SLEW_PPM) || (global_slew_ppm > MAX_SLEW_PPM)) {
+                fprintf(stderr, "Invalid slew rate: %s\n", argv[i]);
+                print_usage(argv);
+                return -1;
+            }
+        } else if ((strcmp(argv[i], "-b") == 0) && ((i + 1) < argc) && is_syncing) {
+            if (parse_backward_step_policy(argv[++i], &global_backward_step_policy) != 0) {
+                fprintf(stderr, "Invalid backward step policy: %s\n", argv[i]);
+                print_usage(argv);
+                return -1;
+            }
+        } else if ((strcmp(argv[i], "-p") == 0) && ((i + 1) < argc) && (RUN_MODE_REPLAY != global_run_mode)) {
+            global_ptp_device_name = argv[++i];
+        } else if ((strcmp(argv[i], "-R") == 0) && ((i + 1) < argc) && (RUN_MODE_REPLAY != global_run_mode) && 
+                (RUN_MODE_SIMULATE != global_run_mode)) {
+            char *end = NULL;
+            long priority = strtol(argv[++i], &end, 10);
+            if ((*end != '\0') || (priority < sched_get_priority_min(SCHED_FIFO)) || 
+                    (priority > sched_get_priority_max(SCHED_FIFO))) {
+                fprintf(stderr, "Invalid real-time priority: %s\n", argv[i]);
+                print_usage(argv);
+                return -1;
+            }
+
+            global_rt_priority = (int)priority;
+        } else if ((strcmp(argv[i], "-c") == 0) && ((i + 1) < argc) && (RUN_MODE_REPLAY != global_run_mode) && 
+                (RUN_MODE_SIMULATE != global_run_mode)) {
+            char *end = NULL;
+            long cpu = strtol(argv[++i], &end, 10);
+            if ((*end != '\0') || (cpu < 0) || (cpu >= CPU_SETSIZE)) {
+                fprintf(stderr, "Invalid CPU: %s\n", argv[i]);
+                print_usage(argv);
+                return -1;
+            }
+
+            global_cpu = (int)cpu;
+        } else if ((strcmp(argv[i], "-r") == 0) && ((i + 1) < argc) && is_syncing) {
+            global_trace_file_name = argv[++i];
+        } else if ((strcmp(argv[i], "-n") == 0) && ((i + 1) < argc) && (RUN_MODE_MEASURE == global_run_mode)) {
+            char *end = NULL;
+            long samples = strtol(argv[++i], &end, 10);
+            if ((*end != '\0') || (samples < 1) || (samples > MEASURE_MAX_SAMPLES)) {
+                fprintf(stderr, "Invalid number of samples: %s\n", argv[i]);
+                print_usage(argv);
+                return -1;
+            }
+
+            global_measure_samples = (int)samples;
+        } else if ((strcmp(argv[i], "-d") == 0) && ((i + 1) < argc) && (RUN_MODE_MEASURE == global_run_mode)) {
+            char *end = NULL;
+            long duration_sec = strtol(argv[++i], &end, 10);
+            if ((*end != '\0') || (duration_sec < 0) || (duration_sec > INT_MAX)) {
+                fprintf(stderr, "Invalid duration: %s\n", argv[i]);
+                print_usage(argv);
+                return -1;
+            }
+
+            global_measure_duration_sec = (int)duration_sec;
+        } else if ((strcmp(argv[i], "-j") == 0) && (RUN_MODE_MEASURE == global_run_mode)) {
+            global_is_measure_json = true;
+        } else if ((strcmp(argv[i], "-w") == 0) && is_syncing && (RUN_MODE_SIMULATE != global_run_mode)) {
+            global_is_rtc_write_back_enabled = true;
         } else {
-            fprintf(stderr, "Unknown argument: %s\n", argv[2]);
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
             print_usage(argv);
             return -1;
         }
     }
 
+    if (load_config() != 0) {
+        return -1;
+    }
+
+    if ((RUN_MODE_REPLAY != global_run_mode) && global_trace_file_name) {
+        if (open_trace(global_trace_file_name, true) != 0) {
+            return -1;
+        }
+    }
+
     int ret = run();
 
+    close_trace();
+    close_ptp();
     close_rtc();
 
     return ret;